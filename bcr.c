@@ -5,7 +5,7 @@
 #include <pthread.h>
 #include <assert.h>
 #include <unistd.h>
-#include <time.h>
+#include <zlib.h>
 
 int bcr_verbose = 2;
 
@@ -20,7 +20,7 @@ int bcr_verbose = 2;
 #define RLL_BLOCK_SIZE 0x100000
 
 typedef struct {
-	int c;
+	int c, b0, b1; // blocks in [b0,b1) are deallocated once decoded
 	int64_t l;
 	uint8_t *q, **i;
 } rllitr_t;
@@ -29,6 +29,7 @@ typedef struct {
 	int n, m;
 	uint8_t **z;
 	int64_t l, mc[6];
+	int64_t *cnt; // cnt[i*6+c]: number of symbol c before block i
 } rll_t;
 
 static rll_t *rll_init(void)
@@ -39,6 +40,7 @@ static rll_t *rll_init(void)
 	e->z = malloc(sizeof(void*));
 	e->z[0] = calloc(RLL_BLOCK_SIZE, 1);
 	e->z[0][0] = 7;
+	e->cnt = calloc(6, 8);
 	return e;
 }
 
@@ -47,12 +49,13 @@ static void rll_destroy(rll_t *e)
 	int i;
 	if (e == 0) return;
 	for (i = 0; i < e->n; ++i) free(e->z[i]);
-	free(e->z); free(e);
+	free(e->z); free(e->cnt); free(e);
 }
 
 static void rll_itr_init(const rll_t *e, rllitr_t *itr)
 {
 	itr->i = e->z; itr->q = *itr->i; itr->c = -1; itr->l = 0;
+	itr->b0 = itr->b1 = 0;
 }
 
 static inline void rll_enc0(rll_t *e, rllitr_t *itr, int l, uint8_t c)
@@ -64,7 +67,9 @@ static inline void rll_enc0(rll_t *e, rllitr_t *itr, int l, uint8_t c)
 			e->m <<= 1;
 			e->z = realloc(e->z, e->m * sizeof(void*));
 			memset(e->z + e->n, 0, (e->m - e->n) * sizeof(void*));
+			e->cnt = realloc(e->cnt, e->m * 48);
 		}
+		memcpy(e->cnt + e->n * 6, e->mc, 48);
 		++e->n;
 		itr->i = e->z + e->n - 1;
 		itr->q = *itr->i = calloc(RLL_BLOCK_SIZE, 1);
@@ -92,19 +97,83 @@ static void rll_enc_finalize(rll_t *e, rllitr_t *itr)
 	for (e->l = 0, c = 0; c < 6; ++c) e->l += e->mc[c];
 }
 
-static inline int64_t rll_dec(const rll_t *e, rllitr_t *itr, int *c, int is_free)
+static void rll_next_blk(const rll_t *e, rllitr_t *itr)
+{
+	int b = itr->i - e->z;
+	if (b >= itr->b0 && b < itr->b1) {
+		free(*itr->i);
+		*itr->i = 0;
+	}
+	itr->q = *++itr->i;
+}
+
+static int rll_skip_end(const rll_t *e, rllitr_t *itr) // at an end marker: the end of the stream, or of a block appended by rll_cat()
+{
+	while (*itr->q == 7) {
+		if (itr->i - e->z == e->n - 1) return -1;
+		rll_next_blk(e, itr);
+	}
+	return 0;
+}
+
+static inline int64_t rll_dec(const rll_t *e, rllitr_t *itr, int *c)
 {
 	int64_t l;
-	if (*itr->q == 7) return -1;
+	if (*itr->q == 7 && rll_skip_end(e, itr) < 0) return -1;
 	l = *itr->q>>3; *c = *itr->q&7;
-	if (++itr->q - *itr->i == RLL_BLOCK_SIZE) {
-		if (is_free) {
-			free(*itr->i);
-			*itr->i = 0;
+	if (++itr->q - *itr->i == RLL_BLOCK_SIZE) rll_next_blk(e, itr);
+	return l;
+}
+
+static int rll_find_blk(const rll_t *e, int64_t k) // the last block starting at or before symbol k
+{
+	int lo = 0, hi = e->n - 1;
+	while (lo < hi) {
+		int c, mid = (lo + hi + 1) >> 1;
+		int64_t x = 0;
+		for (c = 0; c < 6; ++c) x += e->cnt[mid * 6 + c];
+		if (x <= k) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+static void rll_itr_seek(const rll_t *e, rllitr_t *itr, int b, int64_t k, int64_t cnt[6]) // cnt[]: symbol counts before k
+{
+	int64_t x, l;
+	int c;
+	memcpy(cnt, e->cnt + b * 6, 48);
+	for (c = 0, x = 0; c < 6; ++c) x += cnt[c];
+	itr->i = e->z + b; itr->q = *itr->i; itr->c = -1; itr->l = 0;
+	itr->b0 = itr->b1 = 0;
+	while (x < k && (l = rll_dec(e, itr, &c)) >= 0) {
+		if (x + l > k) { // the rest of the run is pending
+			itr->c = c, itr->l = x + l - k;
+			cnt[c] += k - x;
+			break;
 		}
-		itr->q = *++itr->i;
+		x += l, cnt[c] += l;
 	}
-	return l;
+}
+
+static void rll_cat(rll_t *e, rll_t *e1) // append e1 to e and deallocate e1; both finalized
+{
+	int i, c;
+	if (e->n + e1->n > e->m) {
+		e->m = e->n + e1->n;
+		kroundup32(e->m);
+		e->z = realloc(e->z, e->m * sizeof(void*));
+		e->cnt = realloc(e->cnt, e->m * 48);
+	}
+	for (i = 0; i < e1->n; ++i) {
+		e->z[e->n + i] = e1->z[i];
+		for (c = 0; c < 6; ++c)
+			e->cnt[(e->n + i) * 6 + c] = e1->cnt[i * 6 + c] + e->mc[c];
+	}
+	e->n += e1->n;
+	for (c = 0; c < 6; ++c) e->mc[c] += e1->mc[c];
+	e->l += e1->l;
+	free(e1->z); free(e1->cnt); free(e1);
 }
 
 static inline void rll_copy(rll_t *e, rllitr_t *itr, const rll_t *e0, rllitr_t *itr0, int64_t k)
@@ -118,7 +187,7 @@ static inline void rll_copy(rll_t *e, rllitr_t *itr, const rll_t *e0, rllitr_t *
 		rll_enc(e, itr, itr0->l, itr0->c); // write all pending symbols
 		k -= itr0->l;
 		for (; k > 0; k -= l) { // we always go into this loop because l0<k
-			l = rll_dec(e0, itr0, &c, 1);
+			l = rll_dec(e0, itr0, &c);
 			rll_enc(e, itr, k < l? k : l, c);
 		}
 		itr0->l = -k; itr0->c = c;
@@ -131,6 +200,7 @@ static inline void rll_copy(rll_t *e, rllitr_t *itr, const rll_t *e0, rllitr_t *
 
 #define LD_SHIFT 20
 #define LD_MASK  ((1U<<LD_SHIFT) - 1)
+#define LD_BUF_SIZE 0x100000 // buffer size for the temporary file
 
 typedef struct {
 	int max;
@@ -163,35 +233,48 @@ inline int ld_get(longdna_t *h, int64_t x)
 	return h->a[x>>LD_SHIFT][(x&LD_MASK)>>5]>>((x&31)<<1)&3;
 }
 
-void ld_dump(const longdna_t *ld, FILE *fp)
+void ld_dump(const longdna_t *ld, gzFile fp)
 {
 	int i, x, zero = 0;
-	fwrite(&ld->max, sizeof(int), 1, fp);
+	gzwrite(fp, &ld->max, sizeof(int));
 	for (i = 0; i < ld->max; ++i)
 		if (ld->a[i]) {
 			x = 1<<LD_SHIFT>>5;
-			fwrite(&x, sizeof(int), 1, fp);
-			fwrite(ld->a[i], 8, 1<<LD_SHIFT>>5, fp);
-		} else fwrite(&zero, sizeof(int), 1, fp);
+			gzwrite(fp, &x, sizeof(int));
+			gzwrite(fp, ld->a[i], 8 * x);
+		} else gzwrite(fp, &zero, sizeof(int));
 }
 
-longdna_t *ld_restore(FILE *fp)
+longdna_t *ld_restore(gzFile fp)
 {
 	longdna_t *ld;
 	int i, x;
 	ld = calloc(1, sizeof(longdna_t));
-	fread(&ld->max, sizeof(int), 1, fp);
+	gzread(fp, &ld->max, sizeof(int));
 	ld->a = calloc(ld->max, sizeof(void*));
 	for (i = 0; i < ld->max; ++i) {
-		fread(&x, sizeof(int), 1, fp);
+		gzread(fp, &x, sizeof(int));
 		if (x) {
 			ld->a[i] = malloc(x *8);
-			fread(ld->a[i], 8, x, fp);
+			gzread(fp, ld->a[i], 8 * x);
 		}
 	}
 	return ld;
 }
 
+typedef struct { // to read the next column in the background
+	gzFile fp;
+	longdna_t *ld;
+	pthread_t tid;
+} ldreader_t;
+
+static void *ld_reader(void *data)
+{
+	ldreader_t *r = (ldreader_t*)data;
+	r->ld = ld_restore(r->fp);
+	return 0;
+}
+
 /******************
  *** Radix sort ***
  ******************/
@@ -209,11 +292,11 @@ typedef struct {
 	rstype_t *b, *e;
 } rsbucket_t;
 
-void rs_sort(rstype_t *beg, rstype_t *end, int n_bits, int s)
+static void rs_classify(rstype_t *beg, rstype_t *end, int n_bits, int s, rsbucket_t *b) // one pass on bits [s,s+n_bits)
 {
 	rstype_t *i;
 	int size = 1<<n_bits, m = size - 1;
-	rsbucket_t *k, b[size], *be = b + size;
+	rsbucket_t *k, *be = b + size;
 
 	for (k = b; k != be; ++k) k->b = k->e = beg;
 	for (i = beg; i != end; ++i) ++b[rskey(*i)>>s&m].e; // count radix
@@ -233,18 +316,33 @@ void rs_sort(rstype_t *beg, rstype_t *end, int n_bits, int s)
 		} else ++k;
 	}
 	for (b->b = beg, k = b + 1; k != be; ++k) k->b = (k-1)->e; // reset k->b
+}
+
+void rs_sort(rstype_t *beg, rstype_t *end, int n_bits, int s);
+
+static void rs_sort_bucket(rsbucket_t *k, int n_bits, int s) // sort a bucket on the bits below the classified ones
+{
+	rstype_t *i;
+	if (k->e - k->b > RS_MIN_SIZE) rs_sort(k->b, k->e, n_bits, s);
+	else if (k->e - k->b > 1) // then use an insertion sort
+		for (i = k->b + 1; i < k->e; ++i)
+			if (rskey(*i) < rskey(*(i - 1))) {
+				rstype_t *j, tmp = *i;
+				for (j = i; j > k->b && rskey(tmp) < rskey(*(j-1)); --j)
+					*j = *(j - 1);
+				*j = tmp;
+			}
+}
+
+void rs_sort(rstype_t *beg, rstype_t *end, int n_bits, int s)
+{
+	int size = 1<<n_bits;
+	rsbucket_t *k, b[size], *be = b + size;
+
+	rs_classify(beg, end, n_bits, s, b);
 	if (s) { // if $s is non-zero, we need to sort buckets
 		s = s > n_bits? s - n_bits : 0;
-		for (k = b; k != be; ++k)
-			if (k->e - k->b > RS_MIN_SIZE) rs_sort(k->b, k->e, n_bits, s);
-			else if (k->e - k->b > 1) // then use an insertion sort
-				for (i = k->b + 1; i < k->e; ++i)
-					if (rskey(*i) < rskey(*(i - 1))) {
-						rstype_t *j, tmp = *i;
-						for (j = i; j > k->b && rskey(tmp) < rskey(*(j-1)); --j)
-							*j = *(j - 1);
-						*j = tmp;
-					}
+		for (k = b; k != be; ++k) rs_sort_bucket(k, n_bits, s);
 	}
 }
 
@@ -302,13 +400,14 @@ typedef struct {
 	rll_t *e;
 	int64_t n, c[6];
 	pair64_t *a;
+	rsbucket_t rb[256]; // buckets after the first radix pass
 } bucket_t;
 
-typedef struct {
-	struct bcr_s *bcr;
-	int class, pos;
-	volatile int toproc;
-} worker_t;
+typedef struct { // a segment of a bucket, merged into the BWT by one job
+	int class, blk, b0, b1; // blk: the block of the old BWT containing p0; [b0,b1): old blocks freed by this job
+	int64_t k0, k1, p0, p1; // insert a[k0..k1) between positions p0 and p1 of the old BWT
+	rll_t *e; // the merged segment
+} bcrseg_t;
 
 struct bcr_s {
 	int max_len, n_threads;
@@ -317,8 +416,21 @@ struct bcr_s {
 	longdna_t **seq;
 	bucket_t bwt[6];
 	char *tmpfn; // temporary file name
-	volatile int proc_cnt; // for multi-threading
+	int is_comp; // compress the temporary file
 	double rt0, ct0; // for timing
+	// the current cycle
+	int pos, rs_shift, n_seg, m_seg;
+	pair64_t *a;
+	int64_t (*rc)[8]; // symbol counts in each range of $a; n_threads ranges
+	bcrseg_t *seg;
+	// the thread pool
+	int n_jobs, n_running, stop;
+	volatile int next_job;
+	unsigned gen;
+	void (*job)(struct bcr_s*, int);
+	pthread_t *tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_work, cv_done;
 };
 
 typedef struct {
@@ -326,15 +438,16 @@ typedef struct {
 	size_t mem;
 } bcrstat_t;
 
-bcr_t *bcr_init(int is_thr, const char *tmpfn)
+bcr_t *bcr_init(int n_threads, const char *tmpfn, int is_comp)
 {
 	bcr_t *b;
 	int i;
 	b = calloc(1, sizeof(bcr_t));
 	bcr_gettime(&b->rt0, &b->ct0);
 	for (i = 0; i < 6; ++i) b->bwt[i].e = rll_init();
-	b->n_threads = is_thr? 4 : 0;
+	b->n_threads = n_threads > 0? n_threads : 1;
 	if (tmpfn) b->tmpfn = strdup(tmpfn);
+	b->is_comp = is_comp;
 	return b;
 }
 
@@ -375,27 +488,134 @@ void bcr_append(bcr_t *b, int len, const uint8_t *seq)
 	++b->n_seqs;
 }
 
+/* A cycle is done in phases, each of which is split into jobs. The jobs of a
+ * phase are taken by the master and the workers from a shared counter; the
+ * workers sleep on a condition variable between phases. */
+
+static void run_jobs(bcr_t *b)
+{
+	int i;
+	while ((i = __sync_fetch_and_add(&b->next_job, 1)) < b->n_jobs)
+		b->job(b, i);
+}
+
+static void *worker(void *data)
+{
+	bcr_t *b = (bcr_t*)data;
+	unsigned gen = 0;
+	pthread_mutex_lock(&b->lock);
+	for (;;) {
+		while (b->gen == gen && !b->stop) pthread_cond_wait(&b->cv_work, &b->lock);
+		if (b->stop) break;
+		gen = b->gen;
+		pthread_mutex_unlock(&b->lock);
+		run_jobs(b);
+		pthread_mutex_lock(&b->lock);
+		if (--b->n_running == 0) pthread_cond_signal(&b->cv_done);
+	}
+	pthread_mutex_unlock(&b->lock);
+	return 0;
+}
+
+static void bcr_run(bcr_t *b, int n_jobs, void (*job)(bcr_t*, int))
+{
+	int i;
+	if (b->n_threads == 1 || n_jobs == 1) {
+		for (i = 0; i < n_jobs; ++i) job(b, i);
+		return;
+	}
+	pthread_mutex_lock(&b->lock);
+	b->job = job, b->n_jobs = n_jobs, b->next_job = 0;
+	b->n_running = b->n_threads - 1;
+	++b->gen;
+	pthread_cond_broadcast(&b->cv_work);
+	pthread_mutex_unlock(&b->lock);
+	run_jobs(b);
+	pthread_mutex_lock(&b->lock);
+	while (b->n_running) pthread_cond_wait(&b->cv_done, &b->lock);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void pool_init(bcr_t *b)
+{
+	pthread_attr_t attr;
+	int i;
+	if (b->n_threads == 1) return;
+	pthread_mutex_init(&b->lock, 0);
+	pthread_cond_init(&b->cv_work, 0);
+	pthread_cond_init(&b->cv_done, 0);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	b->tid = calloc(b->n_threads, sizeof(pthread_t)); // tid[0] is not used; the master is the first thread
+	for (i = 1; i < b->n_threads; ++i) pthread_create(&b->tid[i], &attr, worker, b);
+	pthread_attr_destroy(&attr);
+}
+
+static void pool_destroy(bcr_t *b)
+{
+	int i;
+	if (b->n_threads == 1) return;
+	pthread_mutex_lock(&b->lock);
+	b->stop = 1;
+	pthread_cond_broadcast(&b->cv_work);
+	pthread_mutex_unlock(&b->lock);
+	for (i = 1; i < b->n_threads; ++i) pthread_join(b->tid[i], 0);
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->cv_work);
+	pthread_cond_destroy(&b->cv_done);
+	free(b->tid); b->tid = 0;
+}
+
+#define range_beg(b, i) ((int64_t)((b)->n_seqs * (i) / (b)->n_threads))
+
+static void count_job(bcr_t *b, int i) // count the symbols in the i-th range of $a
+{
+	int64_t k, end = range_beg(b, i + 1), *c = b->rc[i];
+	memset(c, 0, 64);
+	for (k = range_beg(b, i); k < end; ++k) ++c[b->a[k].v&7];
+}
+
+static void rank_job(bcr_t *b, int i) // add the rank among the same symbols; b->rc[i] holds the counts before the range
+{
+	int64_t k, end = range_beg(b, i + 1), *c = b->rc[i];
+	for (k = range_beg(b, i); k < end; ++k) {
+		pair64_t *u = &b->a[k];
+		u->u += c[u->v&7]++;
+	}
+}
+
+static void offset_job(bcr_t *b, int i) // add the start of the bucket; b->rc[0] holds the starts
+{
+	int64_t k, end = range_beg(b, i + 1), *c = b->rc[0];
+	for (k = range_beg(b, i); k < end; ++k) b->a[k].u += c[b->a[k].v&7];
+}
+
 static pair64_t *set_bwt(bcr_t *bcr, pair64_t *a, int pos)
 {
 	int64_t k, c[8], m;
-	int j, l;
+	int i, j, l;
+	bcr->a = a;
 	memset(c, 0, 64);
-	if (pos == 0) {
-		for (k = 0; k < bcr->n_seqs; ++k) {
-			pair64_t *u = &a[k];
-			u->u += c[u->v&7], ++c[u->v&7];
-		}
-	} else {
-		for (k = m = 0; k < bcr->n_seqs; ++k) {
-			pair64_t *u = &a[k];
-			if ((u->v&7) == 0) continue;
-			u->u += c[u->v&7], ++c[u->v&7];
-			if (m == k) ++m;
-			else a[m++] = a[k];
-		}
+	if (bcr->n_threads > 1) { // count first; then turn the counts into the counts before each range
+		bcr_run(bcr, bcr->n_threads, count_job);
+		for (i = 0; i < bcr->n_threads; ++i)
+			for (j = 0; j < 8; ++j) {
+				int64_t x = bcr->rc[i][j];
+				bcr->rc[i][j] = c[j], c[j] += x;
+			}
+		bcr_run(bcr, bcr->n_threads, rank_job);
+	} else { // with one range, the counts are left in rc[0]
+		memset(bcr->rc[0], 0, 64);
+		rank_job(bcr, 0);
+		memcpy(c, bcr->rc[0], 64);
+	}
+	if (pos && c[0]) { // drop finished sequences
+		for (k = m = 0; k < bcr->n_seqs; ++k)
+			if (a[k].v&7) a[m++] = a[k];
 		if (bcr->n_seqs < m) a = realloc(a, m * sizeof(pair64_t));
 		bcr->n_seqs = m;
 	}
+	if (pos) c[0] = 0;
 	bcr->tot += bcr->n_seqs;
 	for (j = 0; j < 6; ++j) bcr->bwt[j].n = c[j];
 	for (l = 0; l < 6; ++l) bcr->bwt[0].c[l] = 0;
@@ -410,114 +630,161 @@ static pair64_t *set_bwt(bcr_t *bcr, pair64_t *a, int pos)
 	rs_classify_alt(a, a + bcr->n_seqs, c);
 	for (j = 0; j < 6; ++j)
 		bcr->c[j] += c[j], bcr->bwt[j].a = a + c[j];
-	for (k = 0; k < bcr->n_seqs; ++k) a[k].u += c[a[k].v&7];
+	bcr->a = a;
+	memcpy(bcr->rc[0], c, 64);
+	bcr_run(bcr, bcr->n_threads, offset_job);
 	return a;
 }
 
-static void next_bwt(bcr_t *bcr, int class, int pos)
+static void sort1_job(bcr_t *b, int i) // the first radix pass on bucket i+1
 {
-	int64_t c[6], k, l;
+	bucket_t *bwt = &b->bwt[i + 1];
+	if (bwt->n) rs_classify(bwt->a, bwt->a + bwt->n, 8, b->rs_shift, bwt->rb);
+}
+
+static void sort2_job(bcr_t *b, int i) // sort a bucket from the first pass
+{
+	bucket_t *bwt = &b->bwt[i / 256 + 1];
+	if (bwt->n) rs_sort_bucket(&bwt->rb[i % 256], 8, b->rs_shift > 8? b->rs_shift - 8 : 0);
+}
+
+static void merge_job(bcr_t *bcr, int i)
+{
+	bcrseg_t *s = &bcr->seg[i];
+	bucket_t *bwt = &bcr->bwt[s->class];
+	int64_t c[6], cnt[6], k, l;
+	int pos = bcr->pos;
 	rllitr_t ir, iw;
-	bucket_t *bwt = &bcr->bwt[class];
 	rll_t *ew, *er = bwt->e;
 
-	if (bwt->n == 0) return;
-	for (k = bcr->tot, l = 0; k; k >>= 1, ++l);
-	if (class) rs_sort(bwt->a, bwt->a + bwt->n, 8, l > 7? l - 7 : 0);
-	for (k = 0; k < bwt->n; ++k) {
+	for (k = s->k0; k < s->k1; ++k) {
 		pair64_t *u = &bwt->a[k];
-		u->u -= k + bcr->c[class];
+		u->u -= k + bcr->c[s->class];
 		u->v = (u->v&~7ULL) | (pos >= (u->v>>3&0xffff)? 0 : ld_get(bcr->seq[pos], u->v>>19) + 1);
 	}
 	ew = rll_init();
-	rll_itr_init(er, &ir);
 	rll_itr_init(ew, &iw);
+	rll_itr_seek(er, &ir, s->blk, s->p0, cnt);
+	ir.b0 = s->b0, ir.b1 = s->b1;
 	memset(c, 0, 48);
-	for (k = l = 0; k < bwt->n; ++k) {
+	for (k = s->k0, l = s->p0; k < s->k1; ++k) {
 		pair64_t *u = &bwt->a[k];
 		int a = u->v&7;
 		if (u->u > l) rll_copy(ew, &iw, er, &ir, u->u - l);
 		l = u->u;
 		rll_enc(ew, &iw, 1, a);
-		u->u = ((ew->mc[a] + iw.l - 1) - c[a]) + bcr->c[a] + bwt->c[a];
+		u->u = ((ew->mc[a] + iw.l - 1) - c[a]) + cnt[a] + bcr->c[a] + bwt->c[a];
 		++c[a];
 	}
-	if (l < er->l) rll_copy(ew, &iw, er, &ir, er->l - l);
+	if (l < s->p1) rll_copy(ew, &iw, er, &ir, s->p1 - l);
 	rll_enc_finalize(ew, &iw);
-	rll_destroy(er);
-	bwt->e = ew;
+	s->e = ew;
 }
-static int worker_aux(worker_t *w)
+
+/* Each bucket is cut into up to n_threads segments at the insertions. A
+ * segment starts at the old BWT position of its first insertion and is merged
+ * into its own run-length stream; the streams are then concatenated at block
+ * boundaries. The old BWT is read by several jobs at once, so a job only
+ * frees the blocks that no other segment touches. */
+
+static void next_bwt(bcr_t *bcr, int pos)
 {
-	struct timespec req, rem;
-	req.tv_sec = 0; req.tv_nsec = 1000000;
-	while (!__sync_bool_compare_and_swap(&w->toproc, 1, 0)) nanosleep(&req, &rem);
-	next_bwt(w->bcr, w->class, w->pos);
-	__sync_add_and_fetch(&w->bcr->proc_cnt, 1);
-	return (w->bcr->max_len == w->pos);
-}
+	int64_t k, l;
+	int c, j, n_seg;
 
-static void *worker(void *data) { while (worker_aux(data) == 0); return 0; }
+	bcr->pos = pos;
+	for (k = bcr->tot, l = 0; k; k >>= 1, ++l);
+	bcr->rs_shift = l > 7? l - 7 : 0;
+	if (pos) { // sort buckets 1-4; the first radix pass, then the 256 buckets from each
+		bcr_run(bcr, 4, sort1_job);
+		if (bcr->rs_shift) bcr_run(bcr, 4 * 256, sort2_job);
+	}
+	for (c = pos? 1 : 0, bcr->n_seg = 0; c <= (pos? 4 : 0); ++c) {
+		bucket_t *bwt = &bcr->bwt[c];
+		bcrseg_t *s;
+		if (bwt->n == 0) continue;
+		n_seg = bcr->n_threads < (bwt->n>>16) + 1? bcr->n_threads : (bwt->n>>16) + 1; // at least 64k insertions per segment
+		if (bcr->n_seg + n_seg > bcr->m_seg) {
+			bcr->m_seg = bcr->n_seg + n_seg;
+			bcr->seg = realloc(bcr->seg, bcr->m_seg * sizeof(bcrseg_t));
+		}
+		s = bcr->seg + bcr->n_seg;
+		for (j = 0; j < n_seg; ++j) {
+			s[j].class = c;
+			s[j].k0 = bwt->n * j / n_seg, s[j].k1 = bwt->n * (j + 1) / n_seg;
+			s[j].p0 = j? bwt->a[s[j].k0].u - s[j].k0 - bcr->c[c] : 0;
+			s[j].blk = rll_find_blk(bwt->e, s[j].p0);
+		}
+		for (j = 0; j < n_seg; ++j) {
+			s[j].p1 = j < n_seg - 1? s[j+1].p0 : bwt->e->l;
+			s[j].b0 = j? s[j].blk + 1 : 0;
+			s[j].b1 = j < n_seg - 1? s[j+1].blk : bwt->e->n;
+		}
+		bcr->n_seg += n_seg;
+	}
+	bcr_run(bcr, bcr->n_seg, merge_job);
+	for (j = 0; j < bcr->n_seg;) {
+		bucket_t *bwt = &bcr->bwt[bcr->seg[j].class];
+		rll_t *e = bcr->seg[j].e;
+		for (c = bcr->seg[j++].class; j < bcr->n_seg && bcr->seg[j].class == c; ++j)
+			rll_cat(e, bcr->seg[j].e);
+		rll_destroy(bwt->e);
+		bwt->e = e;
+	}
+}
 
 void bcr_build(bcr_t *b)
 {
 	int64_t k;
-	int pos, c, i;
+	int pos;
 	pair64_t *a;
-	FILE *tmpfp = 0;
+	gzFile tmpfp = 0;
+	ldreader_t r;
 	double ct, rt;
-	pthread_t *tid = 0;
-	worker_t *w = 0;
 
 	bcr_gettime(&rt, &ct);
 	if (bcr_verbose >= 3) fprintf(stderr, "Read sequences into memory (%.3fs, %.3fs, %.3fM)\n", rt-b->rt0, ct-b->ct0, bcr_bwtmem(b)/1024./1024.);
 	b->m_seqs = b->n_seqs;
 	b->len = realloc(b->len, b->n_seqs * 2);
 	if (b->tmpfn) {
-		tmpfp = fopen(b->tmpfn, "wb");
+		tmpfp = gzopen(b->tmpfn, b->is_comp? "wb1" : "wbT"); // "T" for no compression
+		gzbuffer(tmpfp, LD_BUF_SIZE);
 		for (pos = 0; pos < b->max_len; ++pos) {
 			ld_dump(b->seq[pos], tmpfp);
 			ld_destroy(b->seq[pos]);
 		}
-		fclose(tmpfp);
-		tmpfp = fopen(b->tmpfn, "rb");
+		gzclose(tmpfp);
+		tmpfp = gzopen(b->tmpfn, "rb");
+		gzbuffer(tmpfp, LD_BUF_SIZE);
+		r.fp = tmpfp;
+		if (b->max_len) pthread_create(&r.tid, 0, ld_reader, &r); // read the first column
 		bcr_gettime(&rt, &ct);
 		if (bcr_verbose >= 3) fprintf(stderr, "Saved sequences to the temporary file (%.3fs, %.3fs, %.3fM)\n", rt-b->rt0, ct-b->ct0, bcr_bwtmem(b)/1024./1024.);
 	}
-	if (b->n_threads > 1) {
-		tid = alloca(b->n_threads * sizeof(pthread_t)); // tid[0] is not used, as the worker 0 is launched by the master
-		w = alloca(b->n_threads * sizeof(worker_t));
-		memset(w, 0, b->n_threads * sizeof(worker_t));
-		for (i = 0; i < b->n_threads; ++i) w[i].class = i + 1, w[i].bcr = b;
-		for (i = 1; i < b->n_threads; ++i) pthread_create(&tid[i], 0, worker, &w[i]);
-	}
+	pool_init(b);
+	b->rc = calloc(b->n_threads, 64);
 	a = malloc(b->n_seqs * 16);
 	for (k = 0; k < b->n_seqs; ++k) a[k].u = 0, a[k].v = k<<19|b->len[k]<<3;
 	free(b->len); b->len = 0;
 	for (pos = 0; pos <= b->max_len; ++pos) {
 		a = set_bwt(b, a, pos);
-		if (pos != b->max_len && tmpfp) b->seq[pos] = ld_restore(tmpfp);
-		if (pos) {
-			if (b->n_threads > 1) {
-				for (c = 0; c < b->n_threads; ++c) {
-					volatile int *p = &w[c].toproc;
-					w[c].pos = pos;
-					while (!__sync_bool_compare_and_swap(p, 0, 1));
-				}
-				worker_aux(&w[0]);
-				while (!__sync_bool_compare_and_swap(&b->proc_cnt, b->n_threads, 0));
-			} else for (c = 1; c <= 4; ++c) next_bwt(b, c, pos);
-		} else next_bwt(b, 0, pos);
+		if (pos != b->max_len && tmpfp) { // take the column read in the background and start reading the next
+			pthread_join(r.tid, 0);
+			b->seq[pos] = r.ld;
+			if (pos + 1 < b->max_len) pthread_create(&r.tid, 0, ld_reader, &r);
+		}
+		next_bwt(b, pos);
 		if (pos != b->max_len) ld_destroy(b->seq[pos]);
 		bcr_gettime(&rt, &ct);
 		if (bcr_verbose >= 3) fprintf(stderr, "Finished cycle %d (%.3fs, %.3fs, %.3fM)\n", pos, rt-b->rt0, ct-b->ct0, bcr_bwtmem(b)/1024./1024.);
 	}
-	free(a);
+	free(a); free(b->rc); free(b->seg);
+	b->a = 0, b->rc = 0, b->seg = 0, b->n_seg = b->m_seg = 0;
 	if (tmpfp) {
-		fclose(tmpfp);
+		gzclose(tmpfp);
 		unlink(b->tmpfn);
 	}
-	for (i = 1; i < b->n_threads; ++i) pthread_join(tid[i], 0);
+	pool_destroy(b);
 }
 
 /****************
@@ -541,6 +808,7 @@ const uint8_t *bcr_itr_next(bcritr_t *itr, int *l)
 {
 	rll_t *e;
 	const uint8_t *s;
+	const void *p;
 	if (itr->c == 6) return 0;
 	++itr->i;
 	if (itr->i == itr->b->bwt[itr->c].e->n) {
@@ -549,9 +817,7 @@ const uint8_t *bcr_itr_next(bcritr_t *itr, int *l)
 	}
 	e = itr->b->bwt[itr->c].e;
 	s = e->z[itr->i];
-	if (itr->i == e->n - 1) {
-		for (*l = 0; *l < RLL_BLOCK_SIZE; ++*l)
-			if (s[*l] == 7) break;
-	} else *l = RLL_BLOCK_SIZE;
+	p = memchr(s, 7, RLL_BLOCK_SIZE); // any block may end early after rll_cat()
+	*l = p? (const uint8_t*)p - s : RLL_BLOCK_SIZE;
 	return s;
 }
@@ -40,7 +40,7 @@ extern int bcr_verbose;
 extern "C" {
 #endif
 
-	bcr_t *bcr_init(int is_threaded, const char *tmpfn);
+	bcr_t *bcr_init(int n_threads, const char *tmpfn, int is_comp);
 	void bcr_destroy(bcr_t *b);
 	void bcr_append(bcr_t *b, int len, const uint8_t *seq);
 	void bcr_build(bcr_t *b);
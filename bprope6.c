@@ -2,6 +2,10 @@
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "bprope6.h"
 
 #define MP_CHUNK_SIZE 0x100000 // 1MB per chunk
@@ -42,38 +46,84 @@ static inline void *mp_alloc(mempool_t *mp)
 	return mp->mem[mp->top] + (mp->i++) * mp->size;
 }
 
+/* The run search in insert_to_leaf() dominates insertion. It skips RUN_STEP
+ * runs at a time, summing the run lengths and the lengths of the runs of the
+ * symbol to insert with SSE2, or with 64-bit integer arithmetic otherwise. */
+
+#ifdef __SSE2__
+#define RUN_STEP 16
+
+static inline int run_sum(const uint8_t *s, int a, int *ra)
+{ // sum of the lengths of runs $s[0..15]; *ra is set to the sum for symbol $a
+	__m128i w, v, t, z = _mm_setzero_si128();
+	w = _mm_loadu_si128((const __m128i*)s);
+	v = _mm_and_si128(_mm_srli_epi16(w, 3), _mm_set1_epi8(0x1f)); // run lengths
+	t = _mm_cmpeq_epi8(_mm_and_si128(w, _mm_set1_epi8(7)), _mm_set1_epi8(a)); // 0xff for $a runs
+	t = _mm_sad_epu8(_mm_and_si128(v, t), z);
+	v = _mm_sad_epu8(v, z);
+	*ra = _mm_cvtsi128_si32(t) + _mm_extract_epi16(t, 4);
+	return _mm_cvtsi128_si32(v) + _mm_extract_epi16(v, 4);
+}
+#else
+#define RUN_STEP 8
+#define RUN_ONES 0x0101010101010101ULL
+
+static inline int run_sum(const uint8_t *s, int a, int *ra)
+{ // sum of the lengths of runs $s[0..7]; *ra is set to the sum for symbol $a
+	uint64_t w, v, t;
+	memcpy(&w, s, 8);
+	v = w>>3 & 0x1f * RUN_ONES; // run lengths
+	t = (w ^ a * RUN_ONES) & 7 * RUN_ONES; // a byte is zero iff the run is an $a run
+	t = ((t + 7 * RUN_ONES) >> 3 & RUN_ONES) ^ RUN_ONES; // 1 for $a runs and 0 for others
+	*ra = (v & t * 0xff) * RUN_ONES >> 56;
+	return v * RUN_ONES >> 56; // no overflow as 8*31 < 256
+}
+#endif
+
 static int insert_to_leaf(uint8_t *p, int a, int x, int len, uint64_t c[6])
 { // insert $a after $x symbols in $p; IMPORTANT: the first 4 bytes of $p gives the length of the string
 #define MAX_RUNLEN 31
 #define _insert_after(_n, _s, _i, _b) if ((_i) + 1 != (_n)) memmove(_s+(_i)+2, _s+(_i)+1, (_n)-(_i)-1); _s[(_i)+1] = (_b); ++(_n)
 
-	int r[6], i, l = 0, n = *(int32_t*)p;
+	int r, i, l = 0, n = *(int32_t*)p, m, ra;
 	uint8_t *s = p + 4;
 	if (n == 0) { // if $s is empty, that is easy
 		s[n++] = 1<<3 | a;
 		*(int32_t*)p = n;
 		return 0;
 	}
+	if (x == 0) { // insert to the start of $s; the searches below require $x>0
+		if ((s[0]&7) == a && s[0]>>3 < MAX_RUNLEN) s[0] += 1<<3;
+		else {
+			memmove(s + 1, s, n++);
+			s[0] = 1<<3 | a;
+		}
+		*(int32_t*)p = n;
+		return 0;
+	}
 	if (x < len>>1) { // forwardly search for the run to insert
-		for (i = 0; i < 6; ++i) r[i] = 0;
+		uint8_t *end = s + n;
+		for (r = 0; s + RUN_STEP <= end && l + (m = run_sum(s, a, &ra)) < x; s += RUN_STEP) l += m, r += ra;
 		do {
 			l += *s>>3;
-			r[*s&7] += *s>>3;
+			if ((*s&7) == a) r += *s>>3;
 			++s;
 		} while (l < x);
 	} else { // backwardly search for the run to insert; this block has exactly the same functionality as the above
-		for (i = 0; i < 6; ++i) r[i] = c[i];
-		l = len, s += n;
+		uint8_t *beg = s;
+		for (r = c[a], l = len, s += n; s - RUN_STEP >= beg && l - (m = run_sum(s - RUN_STEP, a, &ra)) >= x; s -= RUN_STEP) l -= m, r -= ra;
 		do {
 			--s;
 			l -= *s>>3;
-			r[*s&7] -= *s>>3;
+			if ((*s&7) == a) r -= *s>>3;
 		} while (l >= x);
-		l += *s>>3; r[*s&7] += *s>>3; ++s;
+		l += *s>>3;
+		if ((*s&7) == a) r += *s>>3;
+		++s;
 	}
 	i = s - p - 4; s = p + 4;
 	assert(i <= n);
-	r[s[--i]&7] -= l - x; // $i now points to the left-most run where $a can be inserted
+	if ((s[--i]&7) == a) r -= l - x; // $i now points to the left-most run where $a can be inserted
 	if (l == x && i != n - 1 && (s[i+1]&7) == a) ++i; // if insert to the end of $i, check if we'd better to the start of ($i+1)
 	if ((s[i]&7) == a) { // insert to a long $a run
 		if (s[i]>>3 == MAX_RUNLEN) { // the run is full
@@ -104,7 +154,7 @@ static int insert_to_leaf(uint8_t *p, int a, int x, int len, uint64_t c[6])
 		n += 2;
 	}
 	*(int32_t*)p = n;
-	return r[a];
+	return r;
 }
 
 typedef struct bpr_node_s {
@@ -113,13 +163,23 @@ typedef struct bpr_node_s {
 	uint64_t c[6]; // marginal counts
 } node_t;
 
+typedef struct { // a B+ tree keeping the BWT symbols of the suffixes starting with the same symbol
+	uint64_t c[6]; // marginal counts
+	node_t *root;
+	mempool_t *node, *leaf; // each tree has its own pools such that different trees can be updated in parallel
+} bptree_t;
+
 struct bprope6_s {
 	int max_nodes, max_runs; // both MUST BE even numbers
 	uint64_t c[6]; // marginal counts
-	node_t *root;
-	mempool_t *node, *leaf;
+	bptree_t t[6]; // $t[a] keeps the suffixes starting with $a; the BWT is the concatenation of the six trees
 };
 
+static inline uint64_t tree_len(const bptree_t *t)
+{
+	return t->c[0] + t->c[1] + t->c[2] + t->c[3] + t->c[4] + t->c[5];
+}
+
 static void print_node(const node_t *p) // recursively print the B+ rope in the Newick format
 {
 	if (p->is_bottom) {
@@ -145,24 +205,33 @@ static void print_node(const node_t *p) // recursively print the B+ rope in the
 	}
 }
 
-void bpr_print(const bprope6_t *rope) { print_node(rope->root); putchar('\n'); }
+void bpr_print(const bprope6_t *rope)
+{
+	int b;
+	putchar('(');
+	for (b = 0; b < 6; ++b) {
+		if (b) putchar(',');
+		print_node(rope->t[b].root);
+	}
+	putchar(')'); putchar('\n');
+}
 
-static inline node_t *split_node(bprope6_t *rope, node_t *u, node_t *v)
+static inline node_t *split_node(const bprope6_t *rope, bptree_t *t, node_t *u, node_t *v)
 { // split $v's child. $u is the first node in the bucket. $v and $u are in the same bucket. IMPORTANT: there is always enough room in $u
 	int j, i = v - u;
 	node_t *w; // $w is the sibling of $v
 	if (u == 0) { // only happens at the root; add a new root
-		u = v = mp_alloc(rope->node);
-		v->n = 1; v->p = rope->root; // the new root has the old root as the only child
-		memcpy(v->c, rope->c, 48);
+		u = v = mp_alloc(t->node);
+		v->n = 1; v->p = t->root; // the new root has the old root as the only child
+		memcpy(v->c, t->c, 48);
 		for (j = 0; j < 6; ++j) v->l += v->c[j];
-		rope->root = v;
+		t->root = v;
 	}
 	if (i != u->n - 1) // then make room for a new node
 		memmove(v + 2, v + 1, sizeof(node_t) * (u->n - i - 1));
 	++u->n; w = v + 1;
 	memset(w, 0, sizeof(node_t));
-	w->p = mp_alloc(u->is_bottom? rope->leaf : rope->node);
+	w->p = mp_alloc(u->is_bottom? t->leaf : t->node);
 	if (u->is_bottom) { // we are at the bottom level; $v->p is a string instead of a node
 		uint8_t *p = (uint8_t*)v->p, *q = (uint8_t*)w->p;
 		int32_t *np = (int32_t*)p, *nq = (int32_t*)q; // the first 4 bytes give the number of runs (#runs)
@@ -186,15 +255,13 @@ static inline node_t *split_node(bprope6_t *rope, node_t *u, node_t *v)
 	return v;
 }
 
-int64_t bpr_insert_symbol(bprope6_t *rope, int a, int64_t x)
-{ // insert $a after $x symbols in $rope and the returns the position of the next insertion
-	node_t *u = 0, *v = 0, *p = rope->root; // $v is the parent of $p; $u and $v are at the same level and $u is the first node in the bucket
-	int64_t y = 0, z;
-	int i;
-	for (i = 0, z = 0; i < a; ++i) z += rope->c[i];
+static int64_t tree_insert(const bprope6_t *rope, bptree_t *t, int a, int64_t x)
+{ // insert $a after $x symbols in $t and return the number of $a before the inserted symbol
+	node_t *u = 0, *v = 0, *p = t->root; // $v is the parent of $p; $u and $v are at the same level and $u is the first node in the bucket
+	int64_t y = 0, z = 0;
 	do { // top-down update. Searching and node splitting are done together in one pass.
 		if (p->n == rope->max_nodes) { // node is full; split
-			v = split_node(rope, u, v); // $v points to the parent of $p; when a new root is added, $v points to the root
+			v = split_node(rope, t, u, v); // $v points to the parent of $p; when a new root is added, $v points to the root
 			if (y + v->l < x) // if $v is not long enough after the split, we need to move both $p and its parent $v
 				y += v->l, z += v->c[a], ++v, p = v->p;
 		}
@@ -208,63 +275,203 @@ int64_t bpr_insert_symbol(bprope6_t *rope, int a, int64_t x)
 		if (v) ++v->c[a], ++v->l; // we should not change p->c[a] because this may cause troubles when p's child is split
 		v = p; p = p->p; // descend
 	} while (!u->is_bottom);
-	++rope->c[a]; // $rope->c should be updated after the loop as adding a new root needs the old $rope->c counts
-	z += insert_to_leaf((uint8_t*)p, a, x - y, v->l, v->c) + 1;
+	++t->c[a]; // $t->c should be updated after the loop as adding a new root needs the old $t->c counts
+	z += insert_to_leaf((uint8_t*)p, a, x - y, v->l, v->c);
 	++v->c[a]; ++v->l; // this should be below insert_to_leaf(); otherwise insert_to_leaf() will not work
-	if (*(uint32_t*)p + 2 > rope->max_runs) split_node(rope, u, v);
+	if (*(uint32_t*)p + 2 > rope->max_runs) split_node(rope, t, u, v);
+	return z;
+}
+
+/* A string is inserted from its end. Its current suffix sits in the tree of
+ * the symbol inserted last ($ for the first symbol). The new suffix, after
+ * prepending $a, goes to $t[a]; its position there is the number of $a in the
+ * trees before, plus the rank returned by tree_insert(). */
+
+static inline int64_t tree_off(const bprope6_t *rope, int b, int a) // number of $a in trees $t[0..$b-1]
+{
+	int64_t z = 0;
+	int i;
+	for (i = 0; i < b; ++i) z += rope->t[i].c[a];
 	return z;
 }
 
 void bpr_insert_string(bprope6_t *rope, int l, const uint8_t *str)
 {
-	uint64_t x = rope->c[0];
-	for (--l; l >= 0; --l)
-		x = bpr_insert_symbol(rope, str[l], x);
-	bpr_insert_symbol(rope, 0, x);
+	int a, b = 0; // $b: the tree holding the current suffix
+	int64_t x = rope->c[0];
+	do {
+		a = l > 0? str[--l] : 0;
+		x = tree_insert(rope, &rope->t[b], a, x) + tree_off(rope, b, a);
+		++rope->c[a]; b = a;
+	} while (a);
+}
+
+/* Batch insertion: all strings advance by one symbol per cycle. In a cycle,
+ * the insertions into one tree never touch another tree, so the six trees are
+ * updated in parallel. Within a tree, the insertions are applied in the order
+ * of their positions; moving them to the next trees in tree order keeps that
+ * order, such that no explicit sorting is needed. */
+
+#ifdef __GNUC__
+#define bpr_prefetch(p) __builtin_prefetch(p)
+#else
+#define bpr_prefetch(p)
+#endif
+
+#define BATCH_PREFETCH 8 // the strings are visited in a random order; prefetch the symbol this many insertions ahead
+
+typedef struct {
+	uint64_t x; // position in the tree
+	const uint8_t *s; // the string
+	int32_t l, a; // number of symbols not inserted yet; the symbol inserted in the current cycle
+} bprins_t;
+
+typedef struct {
+	bprope6_t *rope;
+	int next, order[6];
+	int64_t n[6];
+	bprins_t *a[6];
+} batch_t;
+
+static void *batch_worker(void *data)
+{
+	batch_t *w = (batch_t*)data;
+	int j;
+	while ((j = __sync_fetch_and_add(&w->next, 1)) < 6) {
+		int b = w->order[j];
+		bprins_t *p, *end = w->a[b] + w->n[b];
+		for (p = w->a[b]; p < end; ++p) {
+			if (p + BATCH_PREFETCH < end && p[BATCH_PREFETCH].l > 0)
+				bpr_prefetch(p[BATCH_PREFETCH].s + p[BATCH_PREFETCH].l - 1);
+			p->a = p->l > 0? p->s[--p->l] : 0;
+			p->x = tree_insert(w->rope, &w->rope->t[b], p->a, p->x);
+		}
+	}
+	return 0;
+}
+
+void bpr_insert_batch(bprope6_t *rope, int64_t n, const int *len, const uint8_t **seq, int n_threads)
+{
+	batch_t w;
+	bprins_t *buf[2];
+	pthread_t tid[6];
+	pthread_attr_t attr;
+	int64_t i;
+	int a, b, j;
+
+	if (n <= 0) return;
+	if (n_threads > 6) n_threads = 6; // one thread per tree at most
+	if (n_threads < 1) n_threads = 1;
+	buf[0] = malloc(n * sizeof(bprins_t));
+	buf[1] = malloc(n * sizeof(bprins_t));
+	memset(&w, 0, sizeof(batch_t));
+	w.rope = rope;
+	for (i = 0; i < n; ++i) // the "$" suffixes of the batch follow the existing ones in the input order
+		buf[0][i].x = rope->c[0] + i, buf[0][i].s = seq[i], buf[0][i].l = len[i];
+	w.a[0] = buf[0], w.n[0] = n;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	while (n > 0) {
+		for (b = 0; b < 6; ++b) w.order[b] = b;
+		for (b = 1; b < 6; ++b) // start from the trees with the most insertions
+			for (j = b; j > 0 && w.n[w.order[j]] > w.n[w.order[j-1]]; --j)
+				a = w.order[j], w.order[j] = w.order[j-1], w.order[j-1] = a;
+		w.next = 0;
+		if (n_threads == 1) batch_worker(&w);
+		else {
+			for (j = 0; j < n_threads; ++j) pthread_create(&tid[j], &attr, batch_worker, &w);
+			for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0);
+		}
+		for (a = 0; a < 6; ++a)
+			for (b = 0, rope->c[a] = 0; b < 6; ++b) rope->c[a] += rope->t[b].c[a];
+		{ // move each unfinished string to the tree of the symbol just inserted
+			int64_t cnt[6], k[6], off[6];
+			bprins_t *p, *end;
+			for (a = 0; a < 6; ++a) cnt[a] = off[a] = 0;
+			for (b = 0; b < 6; ++b)
+				for (p = w.a[b], end = p + w.n[b]; p < end; ++p) ++cnt[p->a];
+			for (a = 1, k[0] = 0, n = 0; a < 6; ++a) k[a] = n, n += cnt[a]; // strings that have inserted $ are done
+			for (b = 0; b < 6; ++b) {
+				for (p = w.a[b], end = p + w.n[b]; p < end; ++p) {
+					if (p->a == 0) continue;
+					buf[1][k[p->a]] = *p;
+					buf[1][k[p->a]++].x += off[p->a];
+				}
+				for (a = 0; a < 6; ++a) off[a] += rope->t[b].c[a];
+			}
+			for (a = 1, w.n[0] = 0; a < 6; ++a) w.a[a] = buf[1] + k[a] - cnt[a], w.n[a] = cnt[a];
+			p = buf[0], buf[0] = buf[1], buf[1] = p;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	free(buf[0]); free(buf[1]);
 }
 
 bprope6_t *bpr_init(int max_nodes, int max_runs)
 {
 	bprope6_t *rope;
+	int b;
 	rope = calloc(1, sizeof(bprope6_t));
 	if (max_runs < 8) max_runs = 8;
 	rope->max_nodes= (max_nodes+ 1)>>1<<1;
 	rope->max_runs = ((max_runs + 1)>>1<<1) - 4; // -4 to make room for the 4-byte integer keeping #runs
-	rope->node = mp_init(sizeof(node_t) * rope->max_nodes);
-	rope->leaf = mp_init(rope->max_runs + 4); // +4 to include the number of runs
-	rope->root = mp_alloc(rope->node);
-	rope->root->n = 1;
-	rope->root->is_bottom = 1;
-	rope->root->p = mp_alloc(rope->leaf);
+	for (b = 0; b < 6; ++b) {
+		bptree_t *t = &rope->t[b];
+		t->node = mp_init(sizeof(node_t) * rope->max_nodes);
+		t->leaf = mp_init(rope->max_runs + 4); // +4 to include the number of runs
+		t->root = mp_alloc(t->node);
+		t->root->n = 1;
+		t->root->is_bottom = 1;
+		t->root->p = mp_alloc(t->leaf);
+	}
 	return rope;
 }
 
 void bpr_destroy(bprope6_t *rope)
 {
-	mp_destroy(rope->node);
-	mp_destroy(rope->leaf);
+	int b;
+	for (b = 0; b < 6; ++b) {
+		mp_destroy(rope->t[b].node);
+		mp_destroy(rope->t[b].leaf);
+	}
 	free(rope);
 }
 
 int64_t bpr_mem(bprope6_t *rope)
 {
-	return (rope->leaf->top + rope->node->top + 2) * MP_CHUNK_SIZE + (rope->leaf->max + rope->node->max) * sizeof(void*)
-		+ sizeof(mempool_t) * 2 + sizeof(bprope6_t) + 10 * sizeof(void*);
+	int64_t mem = sizeof(bprope6_t) + 10 * sizeof(void*);
+	int b;
+	for (b = 0; b < 6; ++b) {
+		const bptree_t *t = &rope->t[b];
+		mem += (t->leaf->top + t->node->top + 2) * MP_CHUNK_SIZE + (t->leaf->max + t->node->max) * sizeof(void*) + sizeof(mempool_t) * 2;
+	}
+	return mem;
 }
 
 struct bpriter_s {
 	const bprope6_t *rope;
 	const node_t *pa[80];
-	int k, ia[80];
+	int b, k, ia[80];
 };
 
+static void iter_next_tree(bpriter_t *i) // move to the leftmost leaf of the next non-empty tree
+{
+	for (++i->b; i->b < 6 && tree_len(&i->rope->t[i->b]) == 0; ++i->b);
+	if (i->b == 6) {
+		i->k = -1;
+		return;
+	}
+	for (i->k = 0, i->pa[0] = i->rope->t[i->b].root; !i->pa[i->k]->is_bottom;) // descend to the leftmost leaf
+		++i->k, i->pa[i->k] = i->pa[i->k - 1]->p;
+}
+
 bpriter_t *bpr_iter_init(const bprope6_t *rope)
 {
 	bpriter_t *i;
 	i = calloc(1, sizeof(bpriter_t));
 	i->rope = rope;
-	for (i->pa[i->k] = rope->root; !i->pa[i->k]->is_bottom;) // descend to the leftmost leaf
-		++i->k, i->pa[i->k] = i->pa[i->k - 1]->p;
+	i->b = -1;
+	iter_next_tree(i);
 	return i;
 }
 
@@ -276,8 +483,67 @@ const uint8_t *bpr_iter_next(bpriter_t *i, int *n)
 	*n = *(int32_t*)i->pa[i->k][i->ia[i->k]].p;
 	ret = (uint8_t*)i->pa[i->k][i->ia[i->k]].p + 4;
 	while (i->k >= 0 && ++i->ia[i->k] == i->pa[i->k]->n) i->ia[i->k--] = 0; // backtracking
-	if (i->k >= 0)
+	if (i->k >= 0) {
 		while (!i->pa[i->k]->is_bottom) // descend to the leftmost leaf
 			++i->k, i->pa[i->k] = i->pa[i->k - 1][i->ia[i->k - 1]].p;
+	} else iter_next_tree(i);
 	return ret;
 }
+
+/* Rank queries. They follow rld_rank1a() and rld_rank2a(): $k is a 0-based
+ * coordinate and the counts include the symbol at $k. The rope must not be
+ * modified during a query. */
+
+static int tree_rank1a(const bptree_t *t, uint64_t x, uint64_t *ok)
+{ // add the number of each symbol in $t[0..$x] to $ok[] and return $t[$x]
+	const node_t *u, *p = t->root;
+	const uint8_t *s, *end;
+	uint64_t y = 0;
+	int a;
+	while (1) { // descend to the leaf containing $x
+		u = p;
+		for (; y + p->l <= x; ++p) {
+			y += p->l;
+			for (a = 0; a < 6; ++a) ok[a] += p->c[a];
+		}
+		assert(p - u < u->n);
+		if (u->is_bottom) break;
+		p = p->p;
+	}
+	s = (const uint8_t*)p->p + 4, end = s + *(const int32_t*)p->p;
+	if (x - y < p->l>>1) { // search forwardly
+		for (; y + (*s>>3) <= x; ++s) y += *s>>3, ok[*s&7] += *s>>3;
+		ok[*s&7] += x - y + 1;
+	} else { // search backwardly; the same as the above
+		for (a = 0; a < 6; ++a) ok[a] += p->c[a];
+		for (y += p->l, s = end - 1; y - (*s>>3) > x; --s)
+			y -= *s>>3, ok[*s&7] -= *s>>3;
+		ok[*s&7] -= y - x - 1;
+	}
+	return *s&7;
+}
+
+int bpr_rank1a(const bprope6_t *rope, uint64_t k, uint64_t *ok)
+{
+	uint64_t y = 0;
+	int a, b;
+	for (a = 0; a < 6; ++a) ok[a] = 0;
+	if (k == (uint64_t)-1) return -1;
+	for (b = 0; b < 6 && y + tree_len(&rope->t[b]) <= k; ++b) { // find the tree containing $k
+		y += tree_len(&rope->t[b]);
+		for (a = 0; a < 6; ++a) ok[a] += rope->t[b].c[a];
+	}
+	return b < 6? tree_rank1a(&rope->t[b], k - y, ok) : -1;
+}
+
+void bpr_rank2a(const bprope6_t *rope, uint64_t k, uint64_t l, uint64_t *ok, uint64_t *ol)
+{
+	bpr_rank1a(rope, k, ok);
+	bpr_rank1a(rope, l, ol);
+}
+
+void bpr_cnt(const bprope6_t *rope, uint64_t cnt[7])
+{
+	int a;
+	for (a = 0, cnt[0] = 0; a < 6; ++a) cnt[a+1] = cnt[a] + rope->c[a];
+}
@@ -42,10 +42,10 @@ extern "C" {
 	bprope6_t *bpr_init(int max_nodes, int max_runs);
 	// deallocate $rope
 	void bpr_destroy(bprope6_t *rope);
-	// insert $a after $x symbols in $rope and returns the position of the next insertion
-	int64_t bpr_insert_symbol(bprope6_t *rope, int a, int64_t x);
 	// insert a string $str of length $l to $rope; NB: a different input order results in a different rope
 	void bpr_insert_string(bprope6_t *rope, int l, const uint8_t *str);
+	// insert $n strings with $n_threads threads; the result is identical to calling bpr_insert_string() in order
+	void bpr_insert_batch(bprope6_t *rope, int64_t n, const int *len, const uint8_t **seq, int n_threads);
 	// print the underlying B+ tree of $rope; for debugging only
 	void bpr_print(const bprope6_t *rope);
 	// ordered iterator
@@ -55,6 +55,13 @@ extern "C" {
 	// memory used by the rope
 	int64_t bpr_mem(bprope6_t *rope);
 
+	// $cnt[a]: the number of symbols smaller than $a, as rld_t::cnt
+	void bpr_cnt(const bprope6_t *rope, uint64_t cnt[7]);
+	// $ok[a]: the number of $a in [0,$k]; return the symbol at $k; the same as rld_rank1a()
+	int bpr_rank1a(const bprope6_t *rope, uint64_t k, uint64_t *ok);
+	// bpr_rank1a() at $k and $l
+	void bpr_rank2a(const bprope6_t *rope, uint64_t k, uint64_t l, uint64_t *ok, uint64_t *ol);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "priv.h"
 
 int fm_bwtgen(int asize, int64_t l, uint8_t *s)
@@ -8,36 +11,109 @@ int fm_bwtgen(int asize, int64_t l, uint8_t *s)
 	else return ksa_bwt64(s, l, asize);
 }
 
-rld_t *fm_bwtenc(int asize, int sbits, int64_t l, const uint8_t *s)
+typedef struct {
+	int asize, sbits;
+	int64_t beg, end;
+	const uint8_t *s;
+	rld_t *e;
+} worker_t;
+
+static void *worker(void *data) // encode s[beg,end) without the rank index
 {
+	worker_t *w = (worker_t*)data;
+	const uint8_t *s = w->s;
 	int c;
 	int64_t i, k;
 	rlditr_t itr;
-	rld_t *e;
 
-	e = rld_init(asize, sbits);
-	rld_itr_init(e, &itr, 0);
-	k = 1; c = s[0];
-	for (i = 1; i < l; ++i) {
+	w->e = rld_init(w->asize, w->sbits);
+	rld_itr_init(w->e, &itr, 0);
+	k = 1; c = s[w->beg];
+	for (i = w->beg + 1; i < w->end; ++i) {
 		if (s[i] != c) {
-			rld_enc(e, &itr, k, c);
+			rld_enc(w->e, &itr, k, c);
 			c = s[i];
 			k = 1;
 		} else ++k;
 	}
-	rld_enc(e, &itr, k, c);
-	rld_enc_finish(e, &itr);
+	rld_enc(w->e, &itr, k, c);
+	rld_enc_finish_mt(w->e, &itr, 0);
+	return 0;
+}
+
+rld_t *fm_bwtenc_mt(int asize, int sbits, int64_t l, const uint8_t *s, int n_threads)
+{
+	pthread_t *tid;
+	pthread_attr_t attr;
+	worker_t *w;
+	rld_t **parts, *e;
+	int j;
+
+	if (n_threads < 1) n_threads = 1;
+	if (n_threads > (l >> 20) + 1) n_threads = (l >> 20) + 1; // at least 1M symbols per thread
+	tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	w = (worker_t*)calloc(n_threads, sizeof(worker_t));
+	parts = (rld_t**)calloc(n_threads, sizeof(void*));
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (j = 0; j < n_threads; ++j) {
+		w[j].asize = asize, w[j].sbits = sbits, w[j].s = s;
+		w[j].beg = l / n_threads * j;
+		w[j].end = j == n_threads - 1? l : l / n_threads * (j + 1);
+		pthread_create(&tid[j], &attr, worker, w + j);
+	}
+	for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0);
+	for (j = 0; j < n_threads; ++j) parts[j] = w[j].e;
+	e = rld_join(n_threads, parts, n_threads);
+	free(parts); free(w); free(tid);
 	return e;
 }
 
-rld_t *fm_build(rld_t *e0, int asize, int sbits, int64_t l, uint8_t *s)
+rld_t *fm_bwtenc(int asize, int sbits, int64_t l, const uint8_t *s)
+{
+	return fm_bwtenc_mt(asize, sbits, l, s, 1);
+}
+
+rld_t *fm_build_parts(int asize, int sbits, int64_t l, uint8_t *s, int n_threads)
+{ // sort the suffixes of parts of s, n_threads at a time, and merge the parts
+	int64_t *len, k, x, n_parts;
+	uint8_t **ss;
+	rld_t **parts;
+	fmlsm_t *lsm;
+	int j, n = 0;
+
+	n_parts = l / INT32_MAX + 1 > n_threads? l / INT32_MAX + 1 : n_threads; // each part fits the 32-bit SA-IS if possible
+	if (n_parts > l / FM_PSA_MIN) n_parts = l / FM_PSA_MIN > 0? l / FM_PSA_MIN : 1;
+	len = (int64_t*)calloc(n_parts, 8);
+	ss = (uint8_t**)calloc(n_parts, sizeof(void*));
+	for (j = 0, x = 0; j < n_parts && x < l; ++j, ++n) { // split s at sentinels
+		k = j == n_parts - 1? l : l / n_parts * (j + 1);
+		if (k <= x) k = x + 1;
+		while (k < l && s[k-1]) ++k;
+		ss[j] = s + x, len[j] = k - x;
+		x = k;
+	}
+	parts = (rld_t**)calloc(n, sizeof(void*));
+	lsm = fm_lsm_init(0, 0, n_threads);
+	for (j = 0; j < n; j += n_threads) {
+		int i, m = n - j < n_threads? n - j : n_threads;
+		fm_build_blocks(m, asize, sbits, len + j, ss + j, parts + j);
+		for (i = j; i < j + m; ++i)
+			fm_lsm_push(lsm, parts[i]);
+	}
+	free(parts); free(len); free(ss);
+	return fm_lsm_finish(lsm);
+}
+
+rld_t *fm_build(rld_t *e0, int asize, int sbits, int64_t l, uint8_t *s, int n_threads)
 {
 	rld_t *e;
 	int64_t ori_l = e0? e0->mcnt[0] : 0;
-	if (!e0) {
+	if (!e0 && n_threads > 1 && l > INT32_MAX) e = fm_build_parts(asize, sbits, l, s, n_threads); // 32-bit SA-IS on each part
+	else if (!e0) {
 		fm_bwtgen(asize, l, s);
-		e = fm_bwtenc(asize, sbits, l, s);
-	} else e = fm_append(e0, l, s);
+		e = fm_bwtenc_mt(asize, sbits, l, s, n_threads);
+	} else e = fm_append_mt(e0, l, s, n_threads);
 	if (fm_verbose >= 3) {
 		int i;
 		fprintf(stderr, "[M::%s] marginal counts: (", __func__);
@@ -49,6 +125,132 @@ rld_t *fm_build(rld_t *e0, int asize, int sbits, int64_t l, uint8_t *s)
 	return e;
 }
 
+/* Blocks of sequences are built independently, one thread for each, and kept
+ * on a stack of sub-indexes. A new sub-index is merged into the one below as
+ * long as it is at least half the size, such that the sizes at least double
+ * down the stack and each symbol is merged O(log n) times. */
+
+typedef struct {
+	int asize, sbits;
+	int64_t l;
+	uint8_t *s;
+	rld_t *e;
+} blk_worker_t;
+
+static void *blk_worker(void *data)
+{
+	blk_worker_t *w = (blk_worker_t*)data;
+	fm_bwtgen(w->asize, w->l, w->s);
+	w->e = fm_bwtenc(w->asize, w->sbits, w->l, w->s);
+	return 0;
+}
+
+void fm_build_blocks(int n, int asize, int sbits, const int64_t *l, uint8_t **s, rld_t **e)
+{
+	pthread_t *tid;
+	pthread_attr_t attr;
+	blk_worker_t *w;
+	int j;
+
+	tid = (pthread_t*)calloc(n, sizeof(pthread_t));
+	w = (blk_worker_t*)calloc(n, sizeof(blk_worker_t));
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (j = 0; j < n; ++j) {
+		w[j].asize = asize, w[j].sbits = sbits, w[j].l = l[j], w[j].s = s[j];
+		pthread_create(&tid[j], &attr, blk_worker, w + j);
+	}
+	for (j = 0; j < n; ++j) pthread_join(tid[j], 0);
+	for (j = 0; j < n; ++j) e[j] = w[j].e;
+	free(w); free(tid);
+}
+
+/* With a prefix for temporary files, each sub-index is dumped as soon as it is
+ * built or merged. To be merged, a sub-index is read back if it fits half of
+ * the memory limit, or memory mapped otherwise. The result of the last merge
+ * stays in memory. */
+
+fmlsm_t *fm_lsm_init(const char *prefix, int64_t max_mem, int n_threads)
+{
+	fmlsm_t *t;
+	t = calloc(1, sizeof(fmlsm_t));
+	t->prefix = prefix? strdup(prefix) : 0;
+	t->max_mem = max_mem;
+	t->n_threads = n_threads;
+	return t;
+}
+
+static void lsm_fn(const fmlsm_t *t, int i, char *fn)
+{
+	sprintf(fn, "%s.%d.fmd", t->prefix, t->id[i]);
+}
+
+static void lsm_put(fmlsm_t *t, rld_t *e, int is_final) // put e at the top
+{
+	int i = t->n++;
+	assert(t->n < FM_LSM_MAX);
+	t->len[i] = e->mcnt[0];
+	t->e[i] = e;
+	if (t->prefix && !is_final) {
+		char *fn = malloc(strlen(t->prefix) + 32);
+		t->id[i] = t->n_tmp++;
+		lsm_fn(t, i, fn);
+		if (rld_dump_mt(e, fn, t->n_threads) < 0) { // keep it in memory then
+			if (fm_verbose >= 2) fprintf(stderr, "[W::%s] failed to write `%s'; the sub-index is kept in memory\n", __func__, fn);
+			unlink(fn);
+		} else {
+			rld_destroy(e);
+			t->e[i] = 0;
+		}
+		free(fn);
+	}
+}
+
+static rld_t *lsm_get(fmlsm_t *t, int i) // take the i-th sub-index out of the stack
+{
+	char *fn;
+	struct stat st;
+	rld_t *e;
+	if (t->e[i]) return t->e[i];
+	fn = malloc(strlen(t->prefix) + 32);
+	lsm_fn(t, i, fn);
+	if (t->max_mem > 0 && stat(fn, &st) == 0 && st.st_size > t->max_mem / 2) e = rld_restore_mmap(fn);
+	else e = rld_restore_mt(fn, t->n_threads);
+	if (e == 0) {
+		if (fm_verbose >= 1) fprintf(stderr, "[E::%s] failed to read back `%s'\n", __func__, fn);
+		abort();
+	}
+	unlink(fn); // still accessible if memory mapped
+	free(fn);
+	return e;
+}
+
+static void lsm_merge_top(fmlsm_t *t, int is_final)
+{
+	rld_t *e0, *e1;
+	e1 = lsm_get(t, t->n - 1);
+	e0 = lsm_get(t, t->n - 2);
+	t->n -= 2;
+	lsm_put(t, fm_merge(e0, e1, t->n_threads), is_final);
+}
+
+void fm_lsm_push(fmlsm_t *t, rld_t *e)
+{
+	lsm_put(t, e, 0);
+	while (t->n >= 2 && t->len[t->n-1] * 2 >= t->len[t->n-2])
+		lsm_merge_top(t, 0);
+}
+
+rld_t *fm_lsm_finish(fmlsm_t *t)
+{
+	rld_t *e = 0;
+	while (t->n >= 2) // merge from the top such that the smaller index is always walked
+		lsm_merge_top(t, t->n == 2);
+	if (t->n) e = lsm_get(t, 0);
+	free(t->prefix); free(t);
+	return e;
+}
+
 rld_t *fm6_build2(int64_t l, const char *seq)
 {
 	int64_t i, j, beg;
@@ -64,7 +266,7 @@ rld_t *fm6_build2(int64_t l, const char *seq)
 		} else ++j;
 	}
 	assert(j == l * 2);
-	e = fm_build(0, 6, 3, l * 2, s);
+	e = fm_build(0, 6, 3, l * 2, s, 1);
 	free(s);
 	return e;
 }
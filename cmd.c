@@ -10,6 +10,74 @@
 #include "kseq.h"
 KSEQ_DECLARE(gzFile)
 
+#define LOAD_MMAP  0x1
+#define LOAD_FAST  0x2
+#define LOAD_NOAUX 0x4 // do not attach the .kmi and .sa sidecar files
+
+#define rld_data_size(e) ((e)->n_bytes + (e)->n_frames * (e)->asize1 * 8)
+
+static rld_t *restore_index(const char *fn, int n_threads)
+{
+	rld_t *e;
+	double t = realtime();
+	e = rld_restore_mt(fn, n_threads);
+	if (e && fm_verbose >= 3) {
+		t = realtime() - t;
+		fprintf(stderr, "[M::%s] read %.1f MB from `%s' in %.3f sec (%.1f MB/s)\n", __func__,
+				rld_data_size(e) / 1048576., fn, t, rld_data_size(e) / 1048576. / (t > 1e-6? t : 1e-6));
+	}
+	return e;
+}
+
+static int dump_index(const rld_t *e, const char *fn, int n_threads)
+{
+	int ret;
+	double t = realtime();
+	if ((ret = rld_dump_mt(e, fn, n_threads)) < 0)
+		fprintf(stderr, "[E::%s] failed to write the FM-index to `%s'\n", __func__, fn);
+	else if (fm_verbose >= 3) {
+		t = realtime() - t;
+		fprintf(stderr, "[M::%s] wrote %.1f MB to `%s' in %.3f sec (%.1f MB/s)\n", __func__,
+				rld_data_size(e) / 1048576., fn, t, rld_data_size(e) / 1048576. / (t > 1e-6? t : 1e-6));
+	}
+	return ret;
+}
+
+static rld_t *load_index(const char *fn, int flag, int n_threads)
+{
+	rld_t *e;
+	char *fnk;
+	if ((e = rld_attach_shm(fn, 0)) != 0)
+		fprintf(stderr, "[M::%s] attached `%s' in shared memory\n", __func__, fn);
+	else if (flag & LOAD_MMAP) e = rld_restore_mmap_opt(fn, RLD_MAP_FRAME(RLD_MAP_WILLNEED)); // frames are hit by every rank query
+	else e = restore_index(fn, n_threads);
+	if (e == 0) return 0;
+	if (flag & LOAD_FAST) {
+		double t = cputime();
+		if (rld_index_fast(e) == 0)
+			fprintf(stderr, "[M::%s] built the uncompressed rank index in %.3f sec\n", __func__, cputime() - t);
+		else fprintf(stderr, "[W::%s] failed to build the uncompressed rank index; fall back to the compressed one\n", __func__);
+	}
+	if (flag & LOAD_NOAUX) return e;
+	fnk = malloc(strlen(fn) + 5);
+	strcat(strcpy(fnk, fn), ".kmi");
+	if (access(fnk, R_OK) == 0 && (e->kmi = fm_kmi_restore(fnk, e)) != 0)
+		fprintf(stderr, "[M::%s] loaded the k-mer interval table up to k=%d from `%s'\n", __func__, e->kmi->k, fnk);
+	strcpy(fnk + strlen(fn), ".sa");
+	if (access(fnk, R_OK) == 0 && (e->sa = fm_sa_restore(fnk, e)) != 0)
+		fprintf(stderr, "[M::%s] loaded the suffix array sampled every %d bases from `%s'\n", __func__, e->sa->rate, fnk);
+	free(fnk);
+	return e;
+}
+
+static void destroy_index(rld_t *e)
+{
+	if (e == 0) return;
+	fm_kmi_destroy(e->kmi);
+	fm_sa_destroy(e->sa);
+	rld_destroy(e);
+}
+
 int main_cnt2qual(int argc, char *argv[])
 {
 	int q = 17, i;
@@ -48,25 +116,34 @@ int main_chkbwt(int argc, char *argv[])
 {
 	rld_t *e;
 	rlditr_t itr;
-	int i, j, l, c = 0, plain = 0, use_mmap = 0, check_rank = 0;
+	int i, j, l, c = 0, plain = 0, load_flag = 0, check_rank = 0, n_threads = 1;
+	int64_t n_bench = 0, n_sa = 0;
 	uint64_t *cnt, *rank, sum = 0;
 	double t;
-	while ((c = getopt(argc, argv, "pMr")) >= 0) {
+	while ((c = getopt(argc, argv, "pMFrb:t:s:")) >= 0) {
 		switch (c) {
 			case 'p': plain = 1; break;
+			case 't': n_threads = atoi(optarg); break;
 			case 'r': check_rank = 1; break;
-			case 'M': use_mmap = 1; break;
+			case 'M': load_flag |= LOAD_MMAP; break;
+			case 'F': load_flag |= LOAD_FAST; break;
+			case 'b': n_bench = atol(optarg); break;
+			case 's': n_sa = atol(optarg); break;
 		}
 	}
 	if (argc == optind) {
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Usage:   fermi chkbwt [options] <idxbase.bwt>\n\n");
 		fprintf(stderr, "Options: -M        load the FM-index as a memory mapped file\n");
+		fprintf(stderr, "         -F        build the uncompressed rank index for faster queries\n");
+		fprintf(stderr, "         -t INT    number of threads for loading the FM-index [1]\n");
 		fprintf(stderr, "         -r        check rank\n");
+		fprintf(stderr, "         -b INT    time INT random rank queries [0]\n");
+		fprintf(stderr, "         -s INT    check the sampled suffix array at INT random rows [0]\n");
 		fprintf(stderr, "         -p        print the BWT to the stdout\n\n");
 		return 1;
 	}
-	e = use_mmap? rld_restore_mmap(argv[optind]) : rld_restore(argv[optind]);
+	e = load_index(argv[optind], load_flag, n_threads);
 	if (e == 0) {
 		fprintf(stderr, "[E::%s] Fail to read the index file.\n", __func__);
 		return 1;
@@ -79,6 +156,52 @@ int main_chkbwt(int argc, char *argv[])
 	}
 	cnt = alloca(e->asize * 8);
 	rank = alloca(e->asize * 8);
+	if (n_bench > 0) { // time random rank queries; the checksum is printed such that different implementations can be compared
+		uint64_t k, r, x = 0;
+		int64_t b;
+		srand48(11);
+		t = cputime();
+		for (b = 0; b < n_bench; ++b) {
+			k = (uint64_t)(drand48() * e->mcnt[0]);
+			x += rld_rank1a(e, k, rank);
+			for (j = 0; j < e->asize; ++j) x += rank[j];
+		}
+		fprintf(stderr, "[M::%s] %ld rld_rank1a() queries in %.3f sec; checksum %llx\n", __func__, (long)n_bench, cputime() - t, (unsigned long long)x);
+		t = cputime();
+		for (b = 0; b < n_bench; ++b) {
+			k = (uint64_t)(drand48() * e->mcnt[0]);
+			r = k + (lrand48() & 0xff);
+			rld_rank2a(e, k, r < e->mcnt[0]? r : e->mcnt[0] - 1, cnt, rank);
+			for (j = 0; j < e->asize; ++j) x += cnt[j] + rank[j];
+		}
+		fprintf(stderr, "[M::%s] %ld rld_rank2a() queries in %.3f sec; checksum %llx\n", __func__, (long)n_bench, cputime() - t, (unsigned long long)x);
+	}
+	if (n_sa > 0) { // locate(LF(k)) must be one base before locate(k) in the same read
+		uint64_t k, id, off, id1, off1;
+		int64_t b;
+		if (e->sa == 0) {
+			fprintf(stderr, "[E::%s] `%s.sa' is required by option -s\n", __func__, argv[optind]);
+			destroy_index(e);
+			return 1;
+		}
+		srand48(11);
+		t = cputime();
+		for (b = 0; b < n_sa; ++b) {
+			k = (uint64_t)(drand48() * e->mcnt[0]);
+			fm_locate(e, k, &id, &off);
+			c = rld_rank1a(e, k, rank);
+			if (c == 0) { // the suffix starts a read
+				if (off == 0) continue;
+			} else if (off > 0) {
+				fm_locate(e, e->cnt[c] + rank[c] - 1, &id1, &off1);
+				if (id1 == id && off1 == off - 1) continue;
+			}
+			fprintf(stderr, "[E::%s] wrong suffix array value at row %lld: (%lld,%lld)\n", __func__,
+					(long long)k, (long long)id, (long long)off);
+			exit(1); // memory leak
+		}
+		fprintf(stderr, "[M::%s] Checked the suffix array at %ld rows in %.3f sec.\n", __func__, (long)n_sa, cputime() - t);
+	}
 	rld_itr_init(e, &itr, 0);
 	for (i = 0; i < e->asize; ++i) cnt[i] = 0;
 	t = cputime();
@@ -115,7 +238,7 @@ int main_chkbwt(int argc, char *argv[])
 		}
 	}
 	if (plain) putchar('\n');
-	rld_destroy(e);
+	destroy_index(e);
 	return 0;
 }
 
@@ -132,12 +255,12 @@ static void print_i(const rld_t *e, uint64_t i, kstring_t *s)
 int main_unpack(int argc, char *argv[])
 {
 	rld_t *e;
-	int c, n, m, use_mmap = 0;
+	int c, n, m, load_flag = 0, n_threads = 1;
 	uint64_t i, *list;
 	kstring_t s;
 	s.m = s.l = 0; s.s = 0;
 	n = m = 0; list = 0;
-	while ((c = getopt(argc, argv, "Mi:")) >= 0) {
+	while ((c = getopt(argc, argv, "MFi:t:")) >= 0) {
 		switch (c) {
 			case 'i':
 				if (n == m) {
@@ -146,17 +269,25 @@ int main_unpack(int argc, char *argv[])
 				}
 				list[n++] = atol(optarg); break;
 				break;
-			case 'M': use_mmap = 1; break;
+			case 't': n_threads = atoi(optarg); break;
+			case 'M': load_flag |= LOAD_MMAP; break;
+			case 'F': load_flag |= LOAD_FAST; break;
 		}
 	}
 	if (argc == optind) {
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Usage:   fermi unpack [-M] [-i index] <seqs.bwt>\n\n");
 		fprintf(stderr, "Options: -i INT    index of the read to output, starting from 0 [null]\n");
-		fprintf(stderr, "         -M        load the FM-index as a memory mapped file\n\n");
+		fprintf(stderr, "         -t INT    number of threads for loading the FM-index [1]\n");
+		fprintf(stderr, "         -M        load the FM-index as a memory mapped file\n");
+		fprintf(stderr, "         -F        build the uncompressed rank index for faster queries\n\n");
+		return 1;
+	}
+	e = load_index(argv[optind], load_flag, n_threads);
+	if (e == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind]);
 		return 1;
 	}
-	e = use_mmap? rld_restore_mmap(argv[optind]) : rld_restore(argv[optind]);
 	if (n) {
 		for (i = 0; (int)i < n; ++i)
 			if (list[i] < e->mcnt[1])
@@ -165,7 +296,7 @@ int main_unpack(int argc, char *argv[])
 		for (i = 0; i < e->mcnt[1]; ++i)
 			print_i(e, i, &s);
 	}
-	rld_destroy(e);
+	destroy_index(e);
 	free(s.s);
 	return 0;
 }
@@ -183,14 +314,16 @@ static uint64_t *load_sorted(uint64_t n, const char *fn)
 
 int main_unitig(int argc, char *argv[])
 {
-	int c, use_mmap = 0, n_threads = 1, min_match = 30;
+	int c, load_flag = 0, n_threads = 1, min_match = 30, use_sa = 0;
 	rld_t *e;
 	uint64_t *sorted = 0;
 	char *fn_sorted = 0;
-	while ((c = getopt(argc, argv, "Ml:t:r:")) >= 0) {
+	while ((c = getopt(argc, argv, "MFSl:t:r:")) >= 0) {
 		switch (c) {
+			case 'S': use_sa = 1; break;
 			case 'l': min_match = atoi(optarg); break;
-			case 'M': use_mmap = 1; break;
+			case 'M': load_flag |= LOAD_MMAP; break;
+			case 'F': load_flag |= LOAD_FAST; break;
 			case 't': n_threads = atoi(optarg); break;
 			case 'r': fn_sorted = strdup(optarg); break;
 		}
@@ -201,30 +334,42 @@ int main_unitig(int argc, char *argv[])
 		fprintf(stderr, "Options: -l INT      min match [%d]\n", min_match);
 		fprintf(stderr, "         -t INT      number of threads [1]\n");
 		fprintf(stderr, "         -r FILE     rank file [null]\n");
+		fprintf(stderr, "         -S          use the rank file in <reads.fmd>.sa if -r is absent\n");
+		fprintf(stderr, "         -F          build the uncompressed rank index for faster queries\n");
 		fprintf(stderr, "\n");
 		return 1;
 	}
-	e = use_mmap? rld_restore_mmap(argv[optind]) : rld_restore(argv[optind]);
+	e = load_index(argv[optind], load_flag, n_threads);
+	if (e == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind]);
+		return 1;
+	}
 	if (fn_sorted) {
 		sorted = load_sorted(e->mcnt[1], fn_sorted);
 		free(fn_sorted);
+	} else if (use_sa && e->sa == 0) {
+		fprintf(stderr, "[E::%s] `%s.sa' is required by option -S\n", __func__, argv[optind]);
+		destroy_index(e);
+		return 1;
 	}
-	fm6_unitig(e, min_match, n_threads, sorted);
+	fm6_unitig(e, min_match, n_threads, sorted? sorted : use_sa? e->sa->rank : 0);
 	free(sorted);
-	rld_destroy(e);
+	destroy_index(e);
 	return 0;
 }
 
 int main_remap(int argc, char *argv[])
 {
-	int c, use_mmap = 0, n_threads = 1, skip = 50, min_pcv = 0, max_dist = 1000;
+	int c, load_flag = 0, n_threads = 1, skip = 50, min_pcv = 0, max_dist = 1000, use_sa = 0;
 	rld_t *e;
 	uint64_t *sorted = 0;
 	char *fn_sorted = 0;
-	while ((c = getopt(argc, argv, "Ml:t:c:r:D:")) >= 0) {
+	while ((c = getopt(argc, argv, "MFSl:t:c:r:D:")) >= 0) {
 		switch (c) {
+			case 'S': use_sa = 1; break;
 			case 'l': skip = atoi(optarg); break;
-			case 'M': use_mmap = 1; break;
+			case 'M': load_flag |= LOAD_MMAP; break;
+			case 'F': load_flag |= LOAD_FAST; break;
 			case 'c': min_pcv = atoi(optarg); break;
 			case 't': n_threads = atoi(optarg); break;
 			case 'D': max_dist = atoi(optarg); break;
@@ -238,27 +383,39 @@ int main_remap(int argc, char *argv[])
 		fprintf(stderr, "         -c INT      minimum paired-end coverage [%d]\n", min_pcv);
 		fprintf(stderr, "         -D INT      maximum insert size (external distance) [%d]\n", max_dist);
 		fprintf(stderr, "         -r FILE     rank [null]\n");
+		fprintf(stderr, "         -S          use the rank in <reads.fmd>.sa if -r is absent\n");
 		fprintf(stderr, "         -t INT      number of threads [1]\n");
+		fprintf(stderr, "         -F          build the uncompressed rank index for faster queries\n");
 		fprintf(stderr, "\n");
 		return 1;
 	}
-	e = use_mmap? rld_restore_mmap(argv[optind]) : rld_restore(argv[optind]);
+	e = load_index(argv[optind], load_flag, n_threads);
+	if (e == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind]);
+		return 1;
+	}
 	if (fn_sorted) sorted = load_sorted(e->mcnt[1], fn_sorted);
-	fm6_remap(argv[optind+1], e, sorted, skip, min_pcv, max_dist, n_threads);
+	else if (use_sa && e->sa == 0) {
+		fprintf(stderr, "[E::%s] `%s.sa' is required by option -S\n", __func__, argv[optind]);
+		destroy_index(e);
+		return 1;
+	}
+	fm6_remap(argv[optind+1], e, sorted? sorted : use_sa? e->sa->rank : 0, skip, min_pcv, max_dist, n_threads);
 	free(sorted);
-	rld_destroy(e);
+	destroy_index(e);
 	return 0;
 }
 
 int main_correct(int argc, char *argv[])
 {
-	int c, use_mmap = 0, n_threads = 1;
+	int c, load_flag = 0, n_threads = 1;
 	rld_t *e;
 	fmecopt_t opt;
 	opt.w = -1; opt.min_occ = 3; opt.keep_bad = 0; opt.is_paired = 0; opt.max_corr = 0.3; opt.trim_l = 0; opt.step = 5;
-	while ((c = getopt(argc, argv, "MKt:k:v:O:pC:l:s:")) >= 0) {
+	while ((c = getopt(argc, argv, "MFKt:k:v:O:pC:l:s:")) >= 0) {
 		switch (c) {
-			case 'M': use_mmap = 1; break;
+			case 'M': load_flag |= LOAD_MMAP; break;
+			case 'F': load_flag |= LOAD_FAST; break;
 			case 'K': opt.keep_bad = 1; break;
 			case 't': n_threads = atoi(optarg); break;
 			case 'k': opt.w = atoi(optarg); break;
@@ -280,42 +437,71 @@ int main_correct(int argc, char *argv[])
 		fprintf(stderr, "         -l INT      trim read down to INT bp; 0 to disable [0]\n");
 		fprintf(stderr, "         -s INT      step size for the jumping heuristic; 0 to disable [%d]\n", opt.step);
 		fprintf(stderr, "         -K          keep bad/unfixable reads\n");
+		fprintf(stderr, "         -F          build the uncompressed rank index for faster queries\n");
 		fprintf(stderr, "\n");
 		return 1;
 	}
-	e = use_mmap? rld_restore_mmap(argv[optind]) : rld_restore(argv[optind]);
+	e = load_index(argv[optind], load_flag, n_threads);
+	if (e == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind]);
+		return 1;
+	}
 	fm6_ec_correct(e, &opt, argv[optind+1], n_threads);
-	rld_destroy(e);
+	destroy_index(e);
 	return 0;
 }
 
 int main_exact(int argc, char *argv[])
 {
-	int c, i, use_mmap = 0, self_match = 0;
+	int c, i, load_flag = 0, self_match = 0, bench = 0, n_threads = 1;
+	int64_t n_bench = 0, n_bench_sym = 0;
+	double t_bench = 0.;
 	rld_t *e;
 	kseq_t *seq;
 	gzFile fp;
 	kstring_t str;
 	fmintv_v a;
 
-	while ((c = getopt(argc, argv, "Ms")) >= 0) {
+	while ((c = getopt(argc, argv, "MFsbt:")) >= 0) {
 		switch (c) {
-			case 'M': use_mmap = 1; break;
+			case 't': n_threads = atoi(optarg); break;
+			case 'M': load_flag |= LOAD_MMAP; break;
+			case 'F': load_flag |= LOAD_FAST; break;
 			case 's': self_match = 1; break;
+			case 'b': bench = 1; break;
 		}
 	}
 	if (optind + 2 > argc) {
-		fprintf(stderr, "Usage: fermi exact [-Ms] <idxbase.bwt> <src.fa>\n");
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   fermi exact [-Msb] <idxbase.bwt> <src.fa>\n\n");
+		fprintf(stderr, "Options: -M        load the FM-index as a memory mapped file\n");
+		fprintf(stderr, "         -F        build the uncompressed rank index for faster queries\n");
+		fprintf(stderr, "         -t INT    number of threads for loading the FM-index [1]\n");
+		fprintf(stderr, "         -s        report self matches\n");
+		fprintf(stderr, "         -b        count and time exact matches of whole sequences\n\n");
 		return 1;
 	}
 	fp = strcmp(argv[optind+1], "-")? gzopen(argv[optind+1], "r") : gzdopen(fileno(stdin), "r");
 	seq = kseq_init(fp);
-	e = use_mmap? rld_restore_mmap(argv[optind]) : rld_restore(argv[optind]);
+	e = load_index(argv[optind], load_flag, n_threads);
+	if (e == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind]);
+		return 1;
+	}
 
 	a.m = a.n = 0; a.a = 0;
 	str.m = str.l = 0; str.s = 0;
 	while (kseq_read(seq) >= 0) {
 		seq_char2nt6(seq->seq.l, (uint8_t*)seq->seq.s);
+		if (bench) { // backward search for the whole sequence
+			uint64_t k, l, n = 0;
+			double t = cputime();
+			if (seq->seq.l) n = fm_backward_search(e, seq->seq.l, (uint8_t*)seq->seq.s, &k, &l);
+			t_bench += cputime() - t;
+			++n_bench, n_bench_sym += seq->seq.l;
+			printf("EX\t%s\t%ld\t%lld\n", seq->name.s, (long)seq->seq.l, (long long)n);
+			continue;
+		}
 		fm6_smem(e, seq->seq.l, (uint8_t*)seq->seq.s, &a, self_match);
 		str.l = 0; kputs("SQ\t", &str); kputs(seq->name.s, &str); kputc('\t', &str); kputw(seq->seq.l, &str); kputc('\t', &str); kputw(a.n, &str);
 		puts(str.s);
@@ -326,12 +512,175 @@ int main_exact(int argc, char *argv[])
 		}
 		puts("//");
 	}
-	rld_destroy(e);
+	if (bench)
+		fprintf(stderr, "[M::%s] %ld backward searches of %ld symbols in %.3f sec (%.2f M symbols/sec)\n", __func__,
+				(long)n_bench, (long)n_bench_sym, t_bench, t_bench > 0.? n_bench_sym / t_bench * 1e-6 : 0.);
+	destroy_index(e);
 	kseq_destroy(seq);
 	gzclose(fp);
 	return 0;
 }
 
+int main_kmi(int argc, char *argv[])
+{
+	int c, k = 10, n_threads = 1;
+	rld_t *e;
+	fmkmi_t *t;
+	char *fn = 0;
+	double t0;
+	while ((c = getopt(argc, argv, "k:t:o:")) >= 0) {
+		switch (c) {
+			case 'k': k = atoi(optarg); break;
+			case 't': n_threads = atoi(optarg); break;
+			case 'o': fn = strdup(optarg); break;
+		}
+	}
+	if (optind + 1 > argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   fermi kmi [options] <reads.fmd>\n\n");
+		fprintf(stderr, "Options: -k INT    max k-mer length, no larger than %d [%d]; the table\n", FM_KMI_MAX_K, k);
+		fprintf(stderr, "                   takes 24*(4^(k+1)-4)/3 bytes in memory and on disk\n");
+		fprintf(stderr, "         -t INT    number of threads [%d]\n", n_threads);
+		fprintf(stderr, "         -o FILE   output file name [<reads.fmd>.kmi]\n\n");
+		return 1;
+	}
+	if (k < 1 || k > FM_KMI_MAX_K) {
+		fprintf(stderr, "[E::%s] the k-mer length must be between 1 and %d\n", __func__, FM_KMI_MAX_K);
+		return 1;
+	}
+	if (fn == 0) {
+		fn = malloc(strlen(argv[optind]) + 5);
+		strcat(strcpy(fn, argv[optind]), ".kmi");
+	}
+	if ((e = load_index(argv[optind], LOAD_NOAUX, n_threads)) == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind]);
+		free(fn);
+		return 1;
+	}
+	t0 = cputime();
+	if ((t = fm_kmi_build(e, k, n_threads)) == 0) {
+		fprintf(stderr, "[E::%s] failed to allocate %llu bytes for the k-mer interval table\n", __func__,
+				(unsigned long long)(((1ULL<<((k+1)<<1)) - 4) / 3 * 24));
+		destroy_index(e);
+		free(fn);
+		return 1;
+	}
+	fprintf(stderr, "[M::%s] computed the intervals of all k-mers up to k=%d in %.3f sec\n", __func__, k, cputime() - t0);
+	if (fm_kmi_dump(t, fn) < 0) {
+		fprintf(stderr, "[E::%s] failed to write file `%s'\n", __func__, fn);
+		k = -1;
+	}
+	fm_kmi_destroy(t);
+	destroy_index(e);
+	free(fn);
+	return k < 0? 1 : 0;
+}
+
+int main_sa(int argc, char *argv[])
+{
+	int c, rate = 32, n_threads = 1, ret = 0, load_flag = LOAD_NOAUX;
+	rld_t *e;
+	fmsa_t *sa;
+	char *fn = 0;
+	double t;
+	while ((c = getopt(argc, argv, "Fr:t:o:")) >= 0) {
+		switch (c) {
+			case 'F': load_flag |= LOAD_FAST; break;
+			case 'r': rate = atoi(optarg); break;
+			case 't': n_threads = atoi(optarg); break;
+			case 'o': fn = strdup(optarg); break;
+		}
+	}
+	if (optind + 1 > argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   fermi sa [options] <reads.fmd>\n\n");
+		fprintf(stderr, "Options: -r INT    sampling rate [%d]\n", rate);
+		fprintf(stderr, "         -t INT    number of threads [%d]\n", n_threads);
+		fprintf(stderr, "         -o FILE   output file name [<reads.fmd>.sa]\n");
+		fprintf(stderr, "         -F        build the uncompressed rank index for faster queries\n\n");
+		return 1;
+	}
+	if (rate < 1) {
+		fprintf(stderr, "[E::%s] the sampling rate must be positive\n", __func__);
+		return 1;
+	}
+	if (fn == 0) {
+		fn = malloc(strlen(argv[optind]) + 4);
+		strcat(strcpy(fn, argv[optind]), ".sa");
+	}
+	if ((e = load_index(argv[optind], load_flag, n_threads)) == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind]);
+		free(fn);
+		return 1;
+	}
+	t = cputime();
+	if ((sa = fm_sa_build(e, rate, n_threads)) == 0) ret = 1;
+	else {
+		fprintf(stderr, "[M::%s] sampled %ld suffixes in %.3f sec\n", __func__, (long)sa->n_ssa, cputime() - t);
+		if (fm_sa_dump(sa, fn) < 0) {
+			fprintf(stderr, "[E::%s] failed to write file `%s'\n", __func__, fn);
+			ret = 1;
+		}
+	}
+	fm_sa_destroy(sa);
+	destroy_index(e);
+	free(fn);
+	return ret;
+}
+
+int main_convert(int argc, char *argv[])
+{
+	int c, ver = 2, ret, n_threads = 1;
+	rld_t *e;
+	while ((c = getopt(argc, argv, "3t:")) >= 0) {
+		switch (c) {
+			case '3': ver = 3; break;
+			case 't': n_threads = atoi(optarg); break;
+		}
+	}
+	if (optind + 1 > argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   fermi convert [-3] [-t nThreads] <in.fmd> [out.fmd]\n\n");
+		fprintf(stderr, "Options: -3        write the RLD\\3 format with checksums (not readable by old fermi)\n");
+		fprintf(stderr, "         -t INT    number of threads for reading and writing [1]\n\n");
+		fprintf(stderr, "Note:    The input can be in RLD\\2, RLD\\3 or the run-length encoding of `ropebwt -b'.\n");
+		fprintf(stderr, "         RLD\\3 inputs are verified against the checksums.\n\n");
+		return 1;
+	}
+	if ((e = restore_index(argv[optind], n_threads)) == 0) {
+		fprintf(stderr, "[E::%s] failed to load the FM-index `%s'\n", __func__, argv[optind]);
+		return 1;
+	}
+	if (ver == 2) ret = dump_index(e, optind + 1 < argc? argv[optind+1] : "-", n_threads);
+	else if ((ret = rld_dump_mt_v3(e, optind + 1 < argc? argv[optind+1] : "-", n_threads)) < 0)
+		fprintf(stderr, "[E::%s] failed to write the FM-index\n", __func__);
+	rld_destroy(e);
+	return ret < 0? 1 : 0;
+}
+
+int main_shm(int argc, char *argv[])
+{
+	int i, ret = 0, is_load;
+	if (argc < 3 || (strcmp(argv[1], "load") && strcmp(argv[1], "unload"))) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   fermi shm load <idx.fmd> [...]\n");
+		fprintf(stderr, "         fermi shm unload <idx.fmd> [...]\n\n");
+		fprintf(stderr, "Note:    Commands loading idx.fmd use the copy in shared memory if present.\n\n");
+		return 1;
+	}
+	is_load = strcmp(argv[1], "load") == 0;
+	for (i = 2; i < argc; ++i) {
+		int r = is_load? rld_shm_load(argv[i]) : rld_shm_unload(argv[i]);
+		if (r == 0) fprintf(stderr, "[M::%s] %s `%s'\n", __func__, is_load? "loaded" : "unloaded", argv[i]);
+		else if (r == -2) fprintf(stderr, "[W::%s] `%s' has already been loaded\n", __func__, argv[i]);
+		else {
+			fprintf(stderr, "[E::%s] failed to %s `%s'\n", __func__, argv[1], argv[i]);
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
 int main_merge(int argc, char *argv[])
 {
 	int i, c, force = 0, n_threads = 1;
@@ -361,46 +710,57 @@ int main_merge(int argc, char *argv[])
 		}
 	}
 	if (idxfn == 0) idxfn = strdup("-");
-	e0 = rld_restore(argv[optind]);
+	e0 = restore_index(argv[optind], n_threads);
 	fprintf(stderr, "[M::%s] Loaded file `%s'.\n", __func__, argv[optind]);
 	for (i = optind + 1; i < argc; ++i) {
-		e1 = rld_restore(argv[i]);
+		e1 = restore_index(argv[i], n_threads);
 		fprintf(stderr, "[M::%s] Loaded file `%s'.\n", __func__, argv[i]);
 		e0 = fm_merge(e0, e1, n_threads); // e0 and e1 will be deallocated during merge
 		fprintf(stderr, "[M::%s] Merged file `%s' to the existing index.\n", __func__, argv[i]);
 	}
-	rld_dump(e0, idxfn);
+	dump_index(e0, idxfn, n_threads);
 	rld_destroy(e0);
 	free(idxfn);
 	return 0;
 }
 
+static int64_t parse_size(const char *str) // with an optional K, M or G suffix
+{
+	double x;
+	char *p;
+	x = strtod(str, &p);
+	if (*p == 'G' || *p == 'g') x *= 1e9;
+	else if (*p == 'M' || *p == 'm') x *= 1e6;
+	else if (*p == 'K' || *p == 'k') x *= 1e3;
+	return (int64_t)(x + .499);
+}
+
 int main_build(int argc, char *argv[]) // this routinue to replace main_index() in future
 {
-	int sbits = 3, force = 0, asize = 6, max_len = INT_MAX, no_fr = 1;
-	int64_t sum_l = 0, l, max, block_size = 250000000;
-	uint8_t *s;
-	char *idxfn = 0;
+	int sbits = 3, force = 0, asize = 6, max_len = INT_MAX, no_fr = 1, n_threads = 1, is_lsm = 0;
+	int i, cur = 0, n_buf = 1, is_block_set = 0;
+	int64_t sum_l = 0, *l, *max, block_size = 250000000, max_mem = 0;
+	uint8_t **s;
+	char *idxfn = 0, *fn_in = 0, *tmp_dir = ".", *prefix = 0;
 	double t;
-	rld_t *e = 0;
+	rld_t *e = 0, **blk;
+	fmlsm_t *lsm = 0;
 
 	{ // parse the command line
 		int c;
-		while ((c = getopt(argc, argv, "fb:o:i:s:l:O")) >= 0) {
+		while ((c = getopt(argc, argv, "fb:o:i:s:l:LOt:m:T:")) >= 0) {
 			switch (c) {
-				case 'i':
-					e = rld_restore(optarg);
-					if (e == 0) {
-						fprintf(stderr, "[E::%s] Fail to open the index file `%s'.\n", __func__, optarg);
-						return 1;
-					}
-					break;
+				case 'i': fn_in = optarg; break;
+				case 't': n_threads = atoi(optarg); break;
 				case 'f': force = 1; break;
 				case 'b': sbits = atoi(optarg); break;
 				case 'o': idxfn = strdup(optarg); break;
-				case 's': block_size = atol(optarg); break;
+				case 's': block_size = parse_size(optarg); is_block_set = 1; break;
 				case 'l': max_len = atoi(optarg); break;
+				case 'L': is_lsm = 1; break;
 				case 'O': no_fr = 0; break;
+				case 'm': max_mem = parse_size(optarg); is_lsm = 1; break;
+				case 'T': tmp_dir = optarg; break;
 			}
 		}
 		if (argc == optind) {
@@ -410,9 +770,13 @@ int main_build(int argc, char *argv[]) // this routinue to replace main_index()
 			fprintf(stderr, "         -f        force to overwrite the output file (effective with -o)\n");
 			fprintf(stderr, "         -i FILE   append the FM-index to the existing FILE [null]\n");
 			fprintf(stderr, "         -l INT    trim read down to INT bp [inf]\n");
+			fprintf(stderr, "         -L        build blocks independently, -t at a time, and merge them\n");
+			fprintf(stderr, "         -m INT    keep the memory around INT bytes by spilling sub-indexes to disk; implies -L [inf]\n");
 			fprintf(stderr, "         -o FILE   output file name [null]\n");
 			fprintf(stderr, "         -O        do not trim 1bp for reads whose forward and reverse are identical\n");
 			fprintf(stderr, "         -s INT    number of symbols to process at a time [%ld]\n", (long)block_size);
+			fprintf(stderr, "         -t INT    number of threads for I/O, encoding and appending to the FM-index [1]\n");
+			fprintf(stderr, "         -T DIR    directory for the temporary files with -m [.]\n");
 			fprintf(stderr, "\n");
 			return 1;
 		}
@@ -424,6 +788,22 @@ int main_build(int argc, char *argv[]) // this routinue to replace main_index()
 				return 1;
 			}
 		} else idxfn = strdup("-");
+		if (fn_in && (e = restore_index(fn_in, n_threads)) == 0) {
+			fprintf(stderr, "[E::%s] Fail to open the index file `%s'.\n", __func__, fn_in);
+			return 1;
+		}
+		if (is_lsm) { // the existing index is at the bottom of the stack
+			n_buf = n_threads > 0? n_threads : 1;
+			if (max_mem > 0) { // text and SA of the blocks built together take about 8 bytes per symbol
+				int64_t x = max_mem / 8 / n_buf;
+				if (x > INT32_MAX) x = INT32_MAX;
+				if (x < block_size || !is_block_set) block_size = x;
+				prefix = (char*)malloc(strlen(tmp_dir) + 32);
+				sprintf(prefix, "%s/fermi.%d", tmp_dir, (int)getpid());
+			}
+			lsm = fm_lsm_init(prefix, max_mem, n_threads);
+			if (e) fm_lsm_push(lsm, e), e = 0;
+		}
 	}
 	
 	{ // read sequences
@@ -438,21 +818,32 @@ int main_build(int argc, char *argv[]) // this routinue to replace main_index()
 			return 1;
 		}
 		seq = kseq_init(fp);
-		l = 0; max = 16;
-		s = malloc(max);
+		s = (uint8_t**)calloc(n_buf, sizeof(void*));
+		l = (int64_t*)calloc(n_buf, 8);
+		max = (int64_t*)calloc(n_buf, 8);
+		blk = (rld_t**)calloc(n_buf, sizeof(void*));
 		t = cputime();
 		while (kseq_read(seq) >= 0) {
 			if (seq->seq.l > max_len)
 				seq->seq.l = max_len, seq->seq.s[max_len] = 0;
-			if (l && l + (seq->seq.l + 1) * 2 > block_size) {
-				e = fm_build(e, asize, sbits, l, s);
-				fprintf(stderr, "[M::%s] Constructed BWT for %lld million symbols in %.3f seconds.\n", __func__, (long long)sum_l/1000000, cputime() - t);
-				l = 0;
+			if (l[cur] && l[cur] + (seq->seq.l + 1) * 2 > block_size) {
+				if (!is_lsm) {
+					e = fm_build(e, asize, sbits, l[0], s[0], n_threads);
+					fprintf(stderr, "[M::%s] Constructed BWT for %lld million symbols in %.3f seconds.\n", __func__, (long long)sum_l/1000000, cputime() - t);
+					l[0] = 0;
+				} else if (++cur == n_buf) { // all the buffers are full
+					fm_build_blocks(n_buf, asize, sbits, l, s, blk);
+					if (max_mem > 0) // release the buffers before merging
+						for (i = 0; i < n_buf; ++i) free(s[i]), s[i] = 0, max[i] = 0;
+					for (i = 0; i < n_buf; ++i) fm_lsm_push(lsm, blk[i]), l[i] = 0;
+					fprintf(stderr, "[M::%s] Constructed BWT for %lld million symbols in %.3f seconds; %d sub-indexes.\n", __func__, (long long)sum_l/1000000, cputime() - t, lsm->n);
+					cur = 0;
+				}
 			}
-			if (l + (seq->seq.l + 1) * 2 > max) { // we do not set max as block_size because this is more flexible
-				max = l + (seq->seq.l + 1) * 2 + 1;
-				kroundup32(max);
-				s = realloc(s, max);
+			if (l[cur] + (seq->seq.l + 1) * 2 > max[cur]) { // we do not set max as block_size because this is more flexible
+				max[cur] = l[cur] + (seq->seq.l + 1) * 2 + 1;
+				kroundup32(max[cur]);
+				s[cur] = realloc(s[cur], max[cur]);
 			}
 			seq_char2nt6(seq->seq.l, (uint8_t*)seq->seq.s);
 			if (no_fr && (seq->seq.l&1) == 0) {
@@ -461,25 +852,34 @@ int main_build(int argc, char *argv[]) // this routinue to replace main_index()
 					if (seq->seq.s[i] + seq->seq.s[seq->seq.l-1-i] != 5) break;
 				if (i == seq->seq.l>>1) --seq->seq.l, seq->seq.s[seq->seq.l] = 0;
 			}
-			memcpy(s + l, seq->seq.s, seq->seq.l + 1);
-			l += seq->seq.l + 1;
+			memcpy(s[cur] + l[cur], seq->seq.s, seq->seq.l + 1);
+			l[cur] += seq->seq.l + 1;
 			seq_revcomp6(seq->seq.l, (uint8_t*)seq->seq.s);
-			memcpy(s + l, seq->seq.s, seq->seq.l + 1);
-			l += seq->seq.l + 1;
+			memcpy(s[cur] + l[cur], seq->seq.s, seq->seq.l + 1);
+			l[cur] += seq->seq.l + 1;
 			sum_l += (seq->seq.l + 1) * 2;
 		}
 		kseq_destroy(seq);
 		gzclose(fp);
 		free(str.s);
-		if (l) {
-			e = fm_build(e, asize, sbits, l, s);
+		if (!is_lsm && l[0]) {
+			e = fm_build(e, asize, sbits, l[0], s[0], n_threads);
+			fprintf(stderr, "[M::%s] Constructed BWT for %lld million symbols in %.3f seconds.\n", __func__, (long long)sum_l/1000000, cputime() - t);
+		} else if (is_lsm) {
+			if (l[cur]) ++cur;
+			fm_build_blocks(cur, asize, sbits, l, s, blk);
+			if (max_mem > 0)
+				for (i = 0; i < n_buf; ++i) free(s[i]), s[i] = 0;
+			for (i = 0; i < cur; ++i) fm_lsm_push(lsm, blk[i]);
+			e = fm_lsm_finish(lsm);
 			fprintf(stderr, "[M::%s] Constructed BWT for %lld million symbols in %.3f seconds.\n", __func__, (long long)sum_l/1000000, cputime() - t);
 		}
 	}
 
-	rld_dump(e, idxfn);
+	dump_index(e, idxfn, n_threads);
 	rld_destroy(e);
-	free(s); free(idxfn);
+	for (i = 0; i < n_buf; ++i) free(s[i]);
+	free(s); free(l); free(max); free(blk); free(idxfn); free(prefix);
 	return 0;
 }
 
@@ -497,11 +897,15 @@ int main_seqsort(int argc, char *argv[])
 		fprintf(stderr, "Usage: fermi seqsort [-t nThreads=1] <reads.fmd>\n");
 		return 1;
 	}
-	e = rld_restore(argv[optind]);
+	e = load_index(argv[optind], 0, n_threads);
+	if (e == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind]);
+		return 1;
+	}
 	sorted = fm6_seqsort(e, n_threads);
 	fwrite(sorted, 8, e->mcnt[1], stdout);
 	free(sorted);
-	rld_destroy(e);
+	destroy_index(e);
 	return 0;
 }
 
@@ -580,9 +984,13 @@ int main_scaf(int argc, char *argv[])
 		return 1;
 	}
 	opt.avg = atof(argv[optind+2]); opt.std = atof(argv[optind+3]);
-	e = rld_restore(argv[optind]);
+	e = load_index(argv[optind], 0, n_threads);
+	if (e == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind]);
+		return 1;
+	}
 	mag_scaf_core(e, argv[optind+1], &opt, n_threads);
-	rld_destroy(e);
+	destroy_index(e);
 	return 0;
 }
 
@@ -610,13 +1018,22 @@ int main_contrast(int argc, char *argv[])
 		return 1;
 	}
 
-	e[0] = rld_restore(argv[optind+0]);
-	e[1] = rld_restore(argv[optind+3]);
+	e[0] = load_index(argv[optind+0], 0, n_threads);
+	if (e[0] == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind+0]);
+		return 1;
+	}
+	e[1] = load_index(argv[optind+3], 0, n_threads);
+	if (e[1] == 0) {
+		fprintf(stderr, "[E::%s] failed to load `%s'\n", __func__, argv[optind+3]);
+		destroy_index(e[0]);
+		return 1;
+	}
 	fm6_contrast(e, k, min_occ, n_threads, sub);
 	n_seqs[0] = e[0]->mcnt[1];
 	n_seqs[1] = e[1]->mcnt[1];
-	rld_destroy(e[0]);
-	rld_destroy(e[1]);
+	destroy_index(e[0]);
+	destroy_index(e[1]);
 
 	rank = malloc((n_seqs[0] > n_seqs[1]? n_seqs[0] : n_seqs[1]) * 8);
 	for (i = 0; i < 2; ++i) {
@@ -653,7 +1070,7 @@ int main_sub(int argc, char *argv[])
 		fprintf(stderr, "Usage: fermi sub [-c] [-t nThreads] <in.fmd> <array.bits>\n");
 		return 1;
 	}
-	e = rld_restore(argv[optind]);
+	e = restore_index(argv[optind], n_threads);
 	fp = fopen(argv[optind+1], "rb");
 	fread(&n_seqs, 8, 1, fp);
 	if (n_seqs != e->mcnt[1]) {
@@ -11,6 +11,10 @@ static fmintv_t descend(const rld_t *e, int suf_len, int suf)
 {
 	int i;
 	fmintv_t ok[6], ik;
+	if (e->kmi && suf_len <= e->kmi->k) {
+		fm_kmi_get(e->kmi, suf_len, suf, &ik);
+		return ik;
+	}
 	fm6_set_intv(e, (suf&3) + 1, ik);
 	for (i = 1; i < suf_len; ++i) {
 		fm6_extend(e, &ik, ok, 1);
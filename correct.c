@@ -33,57 +33,54 @@ static void compute_SUF(int suf_len)
  ***********************/
 
 static void ec_collect(const rld_t *e, const fmecopt_t *opt, int len, const fmintv_t *suf_intv, shash_t *solid, int64_t cnt[2])
-{
-	int i, ret, shift = (opt->w - len - 1) * 2;
-	kstring_t str;
+{ // the bases added to the suffix are kept in ik.info>>32, such that the nodes can be visited in any order
+	int i, n, ret;
 	fmintv_v stack;
-	fmintv_t ok[6], ik;
+	fmintv_t ok[FM_BATCH][6], ik[FM_BATCH];
 
 	if (suf_intv->x[2] == 0) return;
 	assert(len > 0 && opt->w > len);
 	kv_init(stack);
-	str.m = opt->w + 1; str.l = 0;
-	str.s = calloc(str.m, 1);
-	ik = *suf_intv;
-	ik.info = len<<4;
-	kv_push(fmintv_t, stack, ik);
+	ik[0] = *suf_intv;
+	ik[0].info = len<<4;
+	kv_push(fmintv_t, stack, ik[0]);
 	while (stack.n) {
-		int c;
-		ik = kv_pop(stack);
-		fm6_extend(e, &ik, ok, 1);
-		str.l = (ik.info>>4) - len;
-		if (str.l) str.s[str.l - 1] = ik.info&0xf;
-		if (ik.info>>4 == opt->w) { // keep the k-mer
-			uint32_t key;
-			int max_c;
-			khint_t k;
-			uint64_t max, rest;
-			double r;
-			for (c = 1, max = 0, max_c = 6; c <= 4; ++c)
-				if (ok[c].x[2] > max)
-					max = ok[c].x[2], max_c = c;
-			if (max < opt->min_occ) continue; // then in the following max_c<6
-			++cnt[0];
-			rest = ik.x[2] - max - ok[0].x[2] - ok[5].x[2];
-			r = rest == 0? max : (double)max / rest;
-			if (r > 31.) r = 31.; // we have maximally 5 bits of information (i.e. [0,31])
-			if (rest <= 7 && r >= opt->min_occ) ++cnt[1];
-			for (i = 0, key = 0; i < str.l; ++i)
-				key = (uint32_t)str.s[i]<<shift | key>>2;
-			key = key<<2 | (max_c - 1);
-			k = kh_put(solid, solid, key, &ret);
-			kh_val(solid, k) = (int)(r + .499) << 3 | (rest < 7? rest : 7);
-		} else { // descend
-			for (c = 4; c >= 1; --c) { // ambiguous bases are skipped
-				if (ok[c].x[2] >= opt->min_occ) {
-					ok[c].info = ((ik.info>>4) + 1)<<4 | (c - 1);
-					kv_push(fmintv_t, stack, ok[c]);
+		for (n = 0; n < FM_BATCH && stack.n; ++n) // pop a batch of intervals and extend them together
+			ik[n] = kv_pop(stack);
+		fm6_extend_batch(e, n, ik, ok, 1);
+		for (i = 0; i < n; ++i) {
+			fmintv_t *p = &ik[i], *o = ok[i];
+			int c, d = p->info>>4&0xfffffff;
+			if (d == opt->w) { // keep the k-mer
+				uint32_t key;
+				int max_c;
+				khint_t k;
+				uint64_t max, rest;
+				double r;
+				for (c = 1, max = 0, max_c = 6; c <= 4; ++c)
+					if (o[c].x[2] > max)
+						max = o[c].x[2], max_c = c;
+				if (max < opt->min_occ) continue; // then in the following max_c<6
+				++cnt[0];
+				rest = p->x[2] - max - o[0].x[2] - o[5].x[2];
+				r = rest == 0? max : (double)max / rest;
+				if (r > 31.) r = 31.; // we have maximally 5 bits of information (i.e. [0,31])
+				if (rest <= 7 && r >= opt->min_occ) ++cnt[1];
+				key = (uint32_t)(p->info>>32)<<2 | (max_c - 1);
+				k = kh_put(solid, solid, key, &ret);
+				kh_val(solid, k) = (int)(r + .499) << 3 | (rest < 7? rest : 7);
+			} else { // descend
+				for (c = 4; c >= 1; --c) { // ambiguous bases are skipped
+					if (o[c].x[2] >= opt->min_occ) {
+						o[c].info = (p->info>>32 | (uint64_t)(c - 1) << ((d - len) << 1)) << 32 | (uint64_t)(d + 1)<<4;
+						kv_push(fmintv_t, stack, o[c]);
+					}
 				}
 			}
 		}
 	}
 
-	free(stack.a); free(str.s);
+	free(stack.a);
 }
 
 /******************
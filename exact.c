@@ -1,5 +1,6 @@
 #include <assert.h>
 #include "rld.h"
+#include "bprope6.h"
 #include "kstring.h"
 #include "fermi.h"
 #include "kvec.h"
@@ -87,6 +88,24 @@ int fm6_extend(const rld_t *e, const fmintv_t *ik, fmintv_t ok[6], int is_back)
 	return 0;
 }
 
+void fm6_extend_batch(const rld_t *e, int n, const fmintv_t *ik, fmintv_t ok[][6], int is_back)
+{
+	int i, j, m;
+	for (i = 0; i < n; i += FM_BATCH) {
+		m = n - i < FM_BATCH? n - i : FM_BATCH;
+		for (j = i; j < i + m; ++j) { // stage 1: frame entries
+			rld_prefetch_frame(e, ik[j].x[!is_back] - 1);
+			rld_prefetch_frame(e, ik[j].x[!is_back] - 1 + ik[j].x[2]);
+		}
+		for (j = i; j < i + m; ++j) { // stage 2: small blocks, which require the frame entries
+			rld_prefetch_blk(e, ik[j].x[!is_back] - 1);
+			rld_prefetch_blk(e, ik[j].x[!is_back] - 1 + ik[j].x[2]);
+		}
+		for (j = i; j < i + m; ++j)
+			fm6_extend(e, &ik[j], ok[j], is_back);
+	}
+}
+
 int fm6_extend0(const rld_t *e, const fmintv_t *ik, fmintv_t *ok0, int is_back)
 { // FIXME: this can be accelerated a little by using rld_rank1a() when ik.x[2]==1
 	uint64_t tk[6], tl[6];
@@ -97,6 +116,32 @@ int fm6_extend0(const rld_t *e, const fmintv_t *ik, fmintv_t *ok0, int is_back)
 	return 0;
 }
 
+void fm6_set_intv_bpr(const bprope6_t *rope, int c, fmintv_t *ik)
+{
+	uint64_t cnt[7];
+	bpr_cnt(rope, cnt);
+	ik->x[0] = cnt[c], ik->x[2] = cnt[c+1] - cnt[c], ik->x[1] = cnt[fm6_comp(c)], ik->info = 0;
+}
+
+int fm6_extend_bpr(const bprope6_t *rope, const fmintv_t *ik, fmintv_t ok[6], int is_back)
+{ // the same as fm6_extend()
+	uint64_t tk[6], tl[6], cnt[7];
+	int i;
+	bpr_cnt(rope, cnt);
+	bpr_rank2a(rope, ik->x[!is_back] - 1, ik->x[!is_back] - 1 + ik->x[2], tk, tl);
+	for (i = 0; i < 6; ++i) {
+		ok[i].x[!is_back] = cnt[i] + tk[i];
+		ok[i].x[2] = (tl[i] -= tk[i]);
+	}
+	ok[0].x[is_back] = ik->x[is_back];
+	ok[4].x[is_back] = ok[0].x[is_back] + tl[0];
+	ok[3].x[is_back] = ok[4].x[is_back] + tl[4];
+	ok[2].x[is_back] = ok[3].x[is_back] + tl[3];
+	ok[1].x[is_back] = ok[2].x[is_back] + tl[2];
+	ok[5].x[is_back] = ok[1].x[is_back] + tl[1];
+	return 0;
+}
+
 uint64_t fm6_retrieve(const rld_t *e, uint64_t x, kstring_t *s, fmintv_t *k2, int *contained)
 {
 	uint64_t k = x, ok[6];
@@ -144,6 +189,13 @@ fmintv_t *fm6_traverse(const rld_t *e, int depth)
 	fmintv_v stack;
 
 	rst = calloc(1<<depth*2, sizeof(fmintv_t));
+	if (e->kmi && depth >= 1 && depth <= e->kmi->k) { // read from the k-mer interval table
+		uint64_t x;
+		for (x = 0; x < 1ULL<<depth*2; ++x)
+			if (fm_kmi_get(e->kmi, depth, x, &rst[x]))
+				rst[x].info = x<<32 | depth;
+		return rst;
+	}
 	ik.x[0] = ik.x[1] = 0; ik.x[2] = e->mcnt[0]; ik.info = 0;
 	kv_init(stack);
 	kv_push(fmintv_t, stack, ik);
@@ -7,6 +7,12 @@
 #define FERMI_VERSION "1.1-r744"
 
 #define FM_MASK30 0x3fffffff
+#define FM_BATCH  16 // number of intervals to extend in a batch
+
+#define FM_KMI_MAX_K 12 // the .kmi table takes 24*(4^(k+1)-4)/3 bytes, ~0.5GB at k=12
+#define FM_SA_OBITS  24 // bits for the offset in a suffix array sample
+#define FM_LSM_MAX   64 // max depth of the stack of sub-indexes in fmlsm_t
+#define FM_PSA_MIN   0x1000000 // min length of a part in fm_build_parts()
 
 extern int fm_verbose;
 
@@ -21,6 +27,7 @@ typedef struct { size_t n, m; uint64_t *a; } fm64_v;
 typedef struct { size_t n, m; fmintv_t *a; } fmintv_v;
 
 struct __rld_t; // defined in rld.h
+struct bprope6_s; // defined in bprope6.c
 struct __mog_t; // defined in mog.h
 
 typedef struct {
@@ -28,6 +35,33 @@ typedef struct {
 	float max_corr;
 } fmecopt_t;
 
+typedef struct __fmkmi_t { // bi-intervals of all k-mers up to length k; see kmi.c
+	int k, fd;
+	uint64_t n_syms, n_seqs; // mcnt[0] and mcnt[1] of the FM-index
+	uint64_t *x;
+	void *mem; // only used for memory mapped file
+	size_t size;
+} fmkmi_t;
+
+typedef struct __fmsa_t { // sampled suffix array; see ssa.c
+	int rate, fd;
+	uint64_t n_syms, n_seqs, n_ssa; // n_ssa: number of samples
+	uint64_t *bits, *cnt; // sampled rows and the popcount every 512 bits
+	uint64_t *ssa; // samples, as read_id<<FM_SA_OBITS|offset
+	uint64_t *rank; // rank->read map, as read_id<<2; no flags, and may differ from fm6_seqsort() on duplicate and palindromic reads
+	void *mem; // only used for memory mapped file
+	size_t size;
+} fmsa_t;
+
+typedef struct { // stack of sub-indexes for a log-structured build; see build.c
+	int n, n_threads, n_tmp; // n_tmp: number of temporary files created
+	int64_t max_mem;
+	char *prefix;
+	int id[FM_LSM_MAX]; // the i-th sub-index is in file prefix.id[i].fmd if e[i] is NULL
+	uint64_t len[FM_LSM_MAX];
+	struct __rld_t *e[FM_LSM_MAX];
+} fmlsm_t;
+
 typedef struct {
 	int pr_links, min_supp;
 	double avg, std, a_thres, p_thres;
@@ -60,10 +94,48 @@ extern "C" {
 
 	int fm_bwtgen(int asize, int64_t l, uint8_t *s);
 	struct __rld_t *fm_bwtenc(int asize, int sbits, int64_t l, const uint8_t *s);
+	struct __rld_t *fm_bwtenc_mt(int asize, int sbits, int64_t l, const uint8_t *s, int n_threads); // segments encoded in parallel
 	struct __rld_t *fm_append(struct __rld_t *e0, int len, const uint8_t *T);
-	struct __rld_t *fm_build(struct __rld_t *e0, int asize, int sbits, int64_t l, uint8_t *s);
+	struct __rld_t *fm_append_mt(struct __rld_t *e0, int len, const uint8_t *T, int n_threads); // ranks and sorting in parallel
+	struct __rld_t *fm_build(struct __rld_t *e0, int asize, int sbits, int64_t l, uint8_t *s, int n_threads);
 	struct __rld_t *fm6_build2(int64_t l, const char *s);
 
+	/**
+	 * Build the FM-index of s by sorting the suffixes of parts of s, n_threads
+	 * at a time, and merging the parts. With multiple threads, fm_build() uses
+	 * it when s is too long for the 32-bit SA-IS, which halves the workspace.
+	 *
+	 * @param s  sequences, each ended with a sentinel; overwritten
+	 */
+	struct __rld_t *fm_build_parts(int asize, int sbits, int64_t l, uint8_t *s, int n_threads);
+
+	/**
+	 * Build n independent FM-indexes, each on its own thread
+	 *
+	 * @param l  lengths of the blocks
+	 * @param s  blocks of sequences, each ended with a sentinel; overwritten
+	 * @param e  output FM-indexes
+	 */
+	void fm_build_blocks(int n, int asize, int sbits, const int64_t *l, uint8_t **s, struct __rld_t **e);
+
+	/**
+	 * Initialize a stack of sub-indexes for a log-structured build
+	 *
+	 * @param prefix     prefix of the temporary files for the sub-indexes; NULL to keep them in memory
+	 * @param max_mem    memory map a sub-index to merge if its file is larger than max_mem/2; 0 for no limit
+	 * @param n_threads  number of threads for merging and I/O
+	 */
+	fmlsm_t *fm_lsm_init(const char *prefix, int64_t max_mem, int n_threads);
+
+	/**
+	 * Push an FM-index to the stack, merging it into the lower ones while it is
+	 * at least half of their size
+	 *
+	 * @param e  FM-index of the sequences following those on the stack; taken over by the stack
+	 */
+	void fm_lsm_push(fmlsm_t *t, struct __rld_t *e);
+	struct __rld_t *fm_lsm_finish(fmlsm_t *t); // merge the whole stack and deallocate t; NULL if empty
+
 	/**
 	 * Backward search for a generic FM-Index
 	 *
@@ -97,8 +169,74 @@ extern "C" {
 	int fm6_extend(const struct __rld_t *e, const fmintv_t *ik, fmintv_t ok[6], int is_back);
 	int fm6_extend0(const struct __rld_t *e, const fmintv_t *ik, fmintv_t *ok0, int is_back);
 
+	/**
+	 * fm6_set_intv() and fm6_extend() on a B+ rope holding both strands of each read
+	 *
+	 * The rope can be queried between insertions, which makes it a dynamic
+	 * FMD-index, but it must not be modified during a query.
+	 */
+	void fm6_set_intv_bpr(const struct bprope6_s *rope, int c, fmintv_t *ik);
+	int fm6_extend_bpr(const struct bprope6_s *rope, const fmintv_t *ik, fmintv_t ok[6], int is_back);
+
+	/**
+	 * Extend n independent SA intervals, prefetching the index for all of them first
+	 *
+	 * @param n        number of intervals
+	 * @param ik       input SA intervals
+	 * @param ok       output SA intervals; ok[i] is the fm6_extend() result of ik[i]
+	 */
+	void fm6_extend_batch(const struct __rld_t *e, int n, const fmintv_t *ik, fmintv_t ok[][6], int is_back);
+
 	fmintv_t *fm6_traverse(const struct __rld_t *e, int depth);
 
+	/**
+	 * Compute the bi-intervals of all k-mers up to length k
+	 *
+	 * @param e          DNA FM-Index
+	 * @param k          max k-mer length, no larger than FM_KMI_MAX_K
+	 * @param n_threads  number of threads
+	 *
+	 * @return the table, or NULL if k is out of range or the table cannot be allocated
+	 */
+	fmkmi_t *fm_kmi_build(const struct __rld_t *e, int k, int n_threads);
+	int fm_kmi_dump(const fmkmi_t *t, const char *fn);
+	fmkmi_t *fm_kmi_restore(const char *fn, const struct __rld_t *e); // memory mapped; e is used for checking and can be NULL
+	void fm_kmi_destroy(fmkmi_t *t);
+
+	/**
+	 * Get the bi-interval of a k-mer
+	 *
+	 * @param len  length of the k-mer
+	 * @param x    k-mer packed as in fm6_traverse(), with the last base in the lowest 2 bits
+	 * @param ik   output bi-interval
+	 *
+	 * @return     size of the interval; 0 if absent or len is out of range
+	 */
+	uint64_t fm_kmi_get(const fmkmi_t *t, int len, uint64_t x, fmintv_t *ik);
+
+	/**
+	 * Sample the suffix array and compute the rank->read map
+	 *
+	 * @param e          DNA FM-Index
+	 * @param rate       sample the rows whose offset in the read is a multiple of rate
+	 * @param n_threads  number of threads
+	 */
+	fmsa_t *fm_sa_build(const struct __rld_t *e, int rate, int n_threads);
+	int fm_sa_dump(const fmsa_t *sa, const char *fn);
+	fmsa_t *fm_sa_restore(const char *fn, const struct __rld_t *e); // memory mapped; e is used for checking and can be NULL
+	void fm_sa_destroy(fmsa_t *sa);
+
+	/**
+	 * Find the read and the offset of a suffix with the sampled suffix array e->sa
+	 *
+	 * @param k        row in the BWT
+	 * @param read_id  read containing the suffix
+	 * @param offset   offset of the suffix in the read; the length of the read for a sentinel
+	 *
+	 * @return         0 on success; -1 if e->sa is absent or k is out of range
+	 */
+	int fm_locate(const struct __rld_t *e, uint64_t k, uint64_t *read_id, uint64_t *offset);
+
 	int fm6_smem1(const struct __rld_t *e, int len, const uint8_t *q, int x, fmintv_v *mem, int self_match);
 	int fm6_smem(const struct __rld_t *e, int len, const uint8_t *q, fmintv_v *mem, int self_match);
 	int fm6_write_smem(const struct __rld_t *e, const fmintv_t *a, kstring_t *s);
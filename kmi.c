@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "priv.h"
+#include "kvec.h"
+
+/* The .kmi file keeps the bi-interval of every k-mer of length 1 to k, packed
+ * in the same way as fm6_traverse(): the last (rightmost) base takes bits 0-1.
+ * Level d starts at entry (4^d-4)/3 and each entry takes three 64-bit words.
+ * The 24-byte header consists of the magic, k, and the total number of
+ * symbols and sequences in the FM-index for a sanity check. */
+
+#define KMI_HDR 24
+
+#define kmi_off(d) (((1ULL<<((d)<<1)) - 4) / 3)
+#define kmi_entry(t, d, y) ((t)->x + (kmi_off(d) + (y)) * 3)
+
+static fmkmi_t *kmi_init(int k)
+{
+	fmkmi_t *t;
+	t = calloc(1, sizeof(fmkmi_t));
+	t->k = k;
+	t->fd = -1;
+	t->x = calloc(kmi_off(k + 1) * 3, 8);
+	if (t->x == 0) {
+		free(t);
+		return 0;
+	}
+	return t;
+}
+
+void fm_kmi_destroy(fmkmi_t *t)
+{
+	if (t == 0) return;
+	if (t->mem) {
+		munmap(t->mem, t->size);
+		close(t->fd);
+	} else free(t->x);
+	free(t);
+}
+
+static void kmi_fill(const rld_t *e, fmkmi_t *t, const fmintv_t *root, int max_d, fmintv_v *stack)
+{ // depth-first traversal from $root down to depth $max_d; ik.info keeps the packed k-mer and the depth
+	fmintv_t ik[FM_BATCH], ok[FM_BATCH][6];
+	int i, n, c;
+	stack->n = 0;
+	kv_push(fmintv_t, *stack, *root);
+	while (stack->n) {
+		for (n = 0; n < FM_BATCH && stack->n;) { // save the intervals and keep those to extend
+			fmintv_t p = kv_pop(*stack);
+			uint64_t *q = kmi_entry(t, p.info&0xff, p.info>>32);
+			q[0] = p.x[0], q[1] = p.x[1], q[2] = p.x[2];
+			if ((int)(p.info&0xff) < max_d) ik[n++] = p;
+		}
+		fm6_extend_batch(e, n, ik, ok, 1);
+		for (i = 0; i < n; ++i) {
+			int d = ik[i].info&0xff;
+			for (c = 1; c <= 4; ++c) {
+				if (ok[i][c].x[2] == 0) continue;
+				ok[i][c].info = (ik[i].info>>32 | (uint64_t)(c - 1) << (d<<1)) << 32 | (d + 1);
+				kv_push(fmintv_t, *stack, ok[i][c]);
+			}
+		}
+	}
+}
+
+typedef struct {
+	const rld_t *e;
+	fmkmi_t *t;
+	int tid, n_threads, s;
+} worker_t;
+
+static void *worker(void *data)
+{
+	worker_t *w = (worker_t*)data;
+	fmintv_v stack;
+	uint64_t x;
+	kv_init(stack);
+	for (x = w->tid; x < 1ULL<<(w->s<<1); x += w->n_threads) {
+		fmintv_t ik;
+		uint64_t *p = kmi_entry(w->t, w->s, x);
+		if (p[2] == 0) continue;
+		ik.x[0] = p[0], ik.x[1] = p[1], ik.x[2] = p[2];
+		ik.info = x<<32 | w->s;
+		kmi_fill(w->e, w->t, &ik, w->t->k, &stack);
+	}
+	free(stack.a);
+	return 0;
+}
+
+fmkmi_t *fm_kmi_build(const rld_t *e, int k, int n_threads)
+{
+	fmkmi_t *t;
+	fmintv_v stack;
+	fmintv_t ik;
+	int c, s;
+	if (k < 1 || k > FM_KMI_MAX_K) return 0;
+	if ((t = kmi_init(k)) == 0) return 0;
+	t->n_syms = e->mcnt[0], t->n_seqs = e->mcnt[1];
+	s = k < 4? k : 4; // levels up to $s are computed in the main thread
+	kv_init(stack);
+	for (c = 1; c <= 4; ++c) {
+		fm6_set_intv(e, c, ik);
+		ik.info = (uint64_t)(c - 1) << 32 | 1;
+		if (ik.x[2]) kmi_fill(e, t, &ik, s, &stack);
+	}
+	free(stack.a);
+	if (s < k) {
+		pthread_t *tid;
+		pthread_attr_t attr;
+		worker_t *w;
+		int j;
+		if (n_threads < 1) n_threads = 1;
+		tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+		w = (worker_t*)calloc(n_threads, sizeof(worker_t));
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+		for (j = 0; j < n_threads; ++j) {
+			w[j].e = e, w[j].t = t, w[j].s = s;
+			w[j].tid = j, w[j].n_threads = n_threads;
+			pthread_create(&tid[j], &attr, worker, w + j);
+		}
+		for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0);
+		free(w); free(tid);
+	}
+	return t;
+}
+
+int fm_kmi_dump(const fmkmi_t *t, const char *fn)
+{
+	FILE *fp;
+	int32_t k = t->k;
+	uint64_t n = kmi_off(t->k + 1) * 3;
+	if ((fp = strcmp(fn, "-")? fopen(fn, "wb") : fdopen(fileno(stdout), "wb")) == 0) return -1;
+	fwrite("KMI\1", 1, 4, fp);
+	fwrite(&k, 4, 1, fp);
+	fwrite(&t->n_syms, 8, 1, fp);
+	fwrite(&t->n_seqs, 8, 1, fp);
+	if (fwrite(t->x, 8, n, fp) != n) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+fmkmi_t *fm_kmi_restore(const char *fn, const rld_t *e)
+{
+	fmkmi_t *t;
+	struct stat st;
+	int fd;
+	int32_t k;
+	uint8_t *mem;
+	if ((fd = open(fn, O_RDONLY)) < 0) return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < KMI_HDR) {
+		close(fd);
+		return 0;
+	}
+	mem = (uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mem == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	memcpy(&k, mem + 4, 4);
+	if (strncmp((char*)mem, "KMI\1", 4) != 0 || k < 1 || k > FM_KMI_MAX_K || (uint64_t)st.st_size != KMI_HDR + kmi_off(k + 1) * 24) {
+		if (fm_verbose >= 1) fprintf(stderr, "[E::%s] `%s' is not a valid k-mer interval file\n", __func__, fn);
+		munmap(mem, st.st_size); close(fd);
+		return 0;
+	}
+	t = calloc(1, sizeof(fmkmi_t));
+	t->k = k, t->fd = fd, t->mem = mem, t->size = st.st_size;
+	memcpy(&t->n_syms, mem + 8, 8);
+	memcpy(&t->n_seqs, mem + 16, 8);
+	t->x = (uint64_t*)(mem + KMI_HDR);
+	if (e && (t->n_syms != e->mcnt[0] || t->n_seqs != e->mcnt[1])) {
+		if (fm_verbose >= 1) fprintf(stderr, "[E::%s] `%s' was not generated from the FM-index\n", __func__, fn);
+		fm_kmi_destroy(t);
+		return 0;
+	}
+	return t;
+}
+
+uint64_t fm_kmi_get(const fmkmi_t *t, int len, uint64_t x, fmintv_t *ik)
+{
+	const uint64_t *p;
+	if (len < 1 || len > t->k) return 0;
+	p = kmi_entry(t, len, x);
+	ik->x[0] = p[0], ik->x[1] = p[1], ik->x[2] = p[2], ik->info = 0;
+	return ik->x[2];
+}
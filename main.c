@@ -24,6 +24,10 @@ int main_remap(int argc, char *argv[]);
 int main_scaf(int argc, char *argv[]);
 int main_contrast(int argc, char *argv[]);
 int main_bitand(int argc, char *argv[]);
+int main_kmi(int argc, char *argv[]);
+int main_convert(int argc, char *argv[]);
+int main_shm(int argc, char *argv[]);
+int main_sa(int argc, char *argv[]);
 
 int main_ropebwt(int argc, char *argv[]);
 int main_example(int argc, char *argv[]);
@@ -74,8 +78,12 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "         ropebwt   Alternative algorithms for constructing FM-index\n");
 		fprintf(stderr, "         chkbwt    Validate the FM-Index\n");
 		fprintf(stderr, "         merge     Merge multiple FM-Indexes\n");
+		fprintf(stderr, "         convert   Convert the FM-Index file format\n");
+		fprintf(stderr, "         shm       Load/unload FM-Indexes to/from shared memory\n");
 		fprintf(stderr, "         unpack    Retrieve DNA sequences\n");
 		fprintf(stderr, "         exact     Find exact matches\n");
+		fprintf(stderr, "         kmi       Precompute the intervals of short k-mers\n");
+		fprintf(stderr, "         sa        Sample the suffix array\n");
 		fprintf(stderr, "         correct   Error correction\n");
 		fprintf(stderr, "         seqrank   Compute the rank of sequences\n");
 		fprintf(stderr, "         unitig    Construct unitigs\n");
@@ -118,6 +126,10 @@ int main(int argc, char *argv[])
 	else if (strcmp(argv[1], "example") == 0) ret = main_example(argc-1, argv+1);
 	else if (strcmp(argv[1], "contrast") == 0) ret = main_contrast(argc-1, argv+1);
 	else if (strcmp(argv[1], "bitand") == 0) ret = main_bitand(argc-1, argv+1);
+	else if (strcmp(argv[1], "kmi") == 0) ret = main_kmi(argc-1, argv+1);
+	else if (strcmp(argv[1], "convert") == 0) ret = main_convert(argc-1, argv+1);
+	else if (strcmp(argv[1], "shm") == 0) ret = main_shm(argc-1, argv+1);
+	else if (strcmp(argv[1], "sa") == 0) ret = main_sa(argc-1, argv+1);
 	else if (strcmp(argv[1], "ropebwt") == 0) ret = main_ropebwt(argc-1, argv+1);
 //	else if (strcmp(argv[1], "test") == 0) ret = main_test(argc-1, argv+1);
 	else {
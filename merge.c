@@ -8,95 +8,236 @@
  * Compute the bit vector *
  **************************/
 
+/* The walks from the sentinels of e1 are handed out to the threads in chunks
+ * of CHUNK_SIZE sequences. The work proceeds in epochs: each thread walks until
+ * it has BLOCK_SIZE positions and partitions them by region of the bit vector;
+ * after a barrier, thread r sets the bits of all the positions in region r.
+ * Regions are disjoint in 64-bit words, so no atomic operations are needed. */
+
 #define BLOCK_SIZE 0x40000
+#define CHUNK_SIZE 256
 #define TIMER_INTV 64
 
+struct worker_s;
+
 typedef struct {
-	int start, step;
-	const rld_t *e0, *e1;
+	int n_threads, n_done;
+	uint64_t next, rsize; // next: next sequence to walk; rsize: number of bits per region
 	uint64_t *bits;
-	int64_t *buf;
+	pthread_barrier_t barrier;
+	struct worker_s *w;
+} shared_t;
+
+typedef struct worker_s {
+	int tid, is_done;
+	const rld_t *e0, *e1;
+	int64_t x, end, k, i; // walking sequence x from chunk [x,end); k: row in e1; i: row in e0; k<0 for no walk
+	int64_t n, *buf, *buf2; // buf2: buf partitioned by region
+	int64_t *off; // off[r]: start of region r in buf2
+	shared_t *s;
 } worker_t;
 
-static inline void update_bits(int n, const int64_t *buf, uint64_t *bits)
+static int gap_fill(worker_t *w) // walk until the buffer is full; return 1 if no sequences are left
 {
-	const int64_t *q, *end = buf + n;
-	for (q = buf; q != end; ++q) {
-		uint64_t *p = bits + (*q>>6);
-		uint64_t x = 1ull<<(*q&0x3f);
-		__sync_or_and_fetch(p, x); // SEE ALSO: http://gcc.gnu.org/onlinedocs/gcc-4.1.2/gcc/Atomic-Builtins.html
+	const rld_t *e0 = w->e0, *e1 = w->e1;
+	uint64_t ok[6];
+	while (w->n < BLOCK_SIZE) {
+		if (w->k < 0) { // start a new walk
+			if (w->x == w->end) { // get the next chunk
+				w->x = __sync_fetch_and_add(&w->s->next, CHUNK_SIZE);
+				if (w->x >= (int64_t)e1->mcnt[1]) {
+					w->x = w->end;
+					return 1;
+				}
+				w->end = w->x + CHUNK_SIZE < (int64_t)e1->mcnt[1]? w->x + CHUNK_SIZE : e1->mcnt[1];
+			}
+			w->k = w->x++;
+			w->i = e0->mcnt[1] - 1;
+		} else {
+			int c = rld_rank1a(e1, w->k, ok);
+			if (c == 0) {
+				w->k = -1;
+				continue;
+			}
+			w->k = e1->cnt[c] + ok[c] - 1;
+			rld_rank1a(e0, w->i, ok);
+			w->i = e0->cnt[c] + ok[c] - 1;
+		}
+		w->buf[w->n++] = w->k + w->i + 1;
 	}
+	return 0;
+}
+
+static void gap_partition(worker_t *w)
+{
+	int r, n_threads = w->s->n_threads;
+	int64_t j, *off = w->off;
+	for (r = 0; r <= n_threads; ++r) off[r] = 0;
+	for (j = 0; j < w->n; ++j) ++off[w->buf[j] / w->s->rsize + 1];
+	for (r = 1; r <= n_threads; ++r) off[r] += off[r-1];
+	for (j = 0; j < w->n; ++j) w->buf2[off[w->buf[j] / w->s->rsize]++] = w->buf[j];
+	for (r = n_threads; r > 0; --r) off[r] = off[r-1]; // restore the starts
+	off[0] = 0;
 }
 
 static void *worker(void *data)
 {
 	worker_t *w = (worker_t*)data;
-	int n = 0;
-	int64_t i, k, x, n_processed = 0;
-	uint64_t *ok;
+	shared_t *s = w->s;
+	int64_t n_processed = 0;
 	double tcpu, treal;
 	tcpu = cputime(); treal = realtime();
-	ok = alloca(8 * w->e0->asize);
-	k = x = w->start;
-	i = w->e0->mcnt[1] - 1;
-	w->buf[n++] = i + k + 1;
 	for (;;) {
-		int c = rld_rank1a(w->e1, k, ok);
-		if (c == 0) {
-			x += w->step;
-			if (x >= w->e1->mcnt[1]) break;
-			k = x;
-			i = w->e0->mcnt[1] - 1;
-		} else {
-			k = w->e1->cnt[c] + ok[c] - 1;
-			rld_rank1a(w->e0, i, ok);
-			i = w->e0->cnt[c] + ok[c] - 1;
+		int t, n_done;
+		if (!w->is_done && gap_fill(w)) {
+			w->is_done = 1;
+			__sync_fetch_and_add(&s->n_done, 1);
 		}
-		if (n == BLOCK_SIZE) {
-			update_bits(n, w->buf, w->bits);
-			if (fm_verbose >= 3 && ++n_processed % TIMER_INTV == 0)
-				fprintf(stderr, "[M::%s@%d] processed %.3f million symbols in %.3f / %.1f seconds.\n", __func__, w->start,
-						(double)n_processed*BLOCK_SIZE/1e6, cputime() - tcpu, (cputime() - tcpu) / (realtime() - treal));
-			n = 0;
+		gap_partition(w);
+		pthread_barrier_wait(&s->barrier);
+		for (t = 0; t < s->n_threads; ++t) { // set the bits in region w->tid from all the threads
+			const worker_t *wt = &s->w[t];
+			int64_t j;
+			for (j = wt->off[w->tid]; j < wt->off[w->tid + 1]; ++j)
+				s->bits[wt->buf2[j]>>6] |= 1ull<<(wt->buf2[j]&0x3f);
 		}
-		w->buf[n++] = k + i + 1;
+		n_done = s->n_done;
+		if (fm_verbose >= 3 && w->n == BLOCK_SIZE && ++n_processed % TIMER_INTV == 0)
+			fprintf(stderr, "[M::%s@%d] processed %.3f million symbols in %.3f / %.1f seconds.\n", __func__, w->tid,
+					(double)n_processed*BLOCK_SIZE/1e6, cputime() - tcpu, (cputime() - tcpu) / (realtime() - treal));
+		pthread_barrier_wait(&s->barrier); // buffers can be refilled after all the regions are done
+		w->n = 0;
+		if (n_done == s->n_threads) break;
 	}
-	if (n) update_bits(n, w->buf, w->bits);
 	return 0;
 }
 
 uint64_t *fm_compute_gap_bits(const rld_t *e0, const rld_t *e1, int n_threads)
 {
-	uint64_t *bits;
+	uint64_t n = e0->mcnt[0] + e1->mcnt[0];
 	pthread_t *tid;
 	pthread_attr_t attr;
 	worker_t *w;
+	shared_t s;
 	int j;
 
+	memset(&s, 0, sizeof(shared_t));
+	s.n_threads = n_threads;
+	s.rsize = ((n + n_threads - 1) / n_threads + 63) >> 6 << 6;
+	s.bits = xcalloc((n + 63) / 64, 8);
+	pthread_barrier_init(&s.barrier, 0, n_threads);
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 	w = (worker_t*)calloc(n_threads, sizeof(worker_t));
 	tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	s.w = w;
 	for (j = 0; j < n_threads; ++j) {
 		worker_t *ww = w + j;
-		ww->e0 = e0; ww->e1 = e1;
-		ww->step = n_threads;
-		ww->start = j;
+		ww->e0 = e0; ww->e1 = e1; ww->s = &s;
+		ww->tid = j;
+		ww->k = -1;
 		ww->buf = xmalloc(BLOCK_SIZE * 8);
+		ww->buf2 = xmalloc(BLOCK_SIZE * 8);
+		ww->off = (int64_t*)calloc(n_threads + 1, 8);
 	}
-	bits = xcalloc((e0->mcnt[0] + e1->mcnt[0] + 63) / 64, 8);
-	for (j = 0; j < n_threads; ++j) w[j].bits = bits;
 	for (j = 0; j < n_threads; ++j) pthread_create(&tid[j], &attr, worker, w + j);
 	for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0);
-	for (j = 0; j < n_threads; ++j) free(w[j].buf);
+	for (j = 0; j < n_threads; ++j) free(w[j].buf), free(w[j].buf2), free(w[j].off);
+	pthread_barrier_destroy(&s.barrier);
 	free(w); free(tid);
-	return bits;
+	return s.bits;
 }
 
 /************************
  * Merge two FM-indexes *
  ************************/
 
+/* With multiple threads, the merged BWT is split into segments at multiples
+ * of 64. Each segment is encoded from e0 and e1 seeked to the positions given
+ * by the popcount of the gap bits, and the segments are joined at the end. */
+
+typedef struct {
+	const rld_t *e0, *e1;
+	const uint64_t *bits;
+	uint64_t beg, end, n1; // segment [beg,end); n1: number of symbols from e1 in the segment or before it
+	rld_t *e;
+} enc_worker_t;
+
+static void *count_worker(void *data)
+{
+	enc_worker_t *w = (enc_worker_t*)data;
+	uint64_t i;
+	for (i = w->beg>>6, w->n1 = 0; i < (w->end + 63)>>6; ++i)
+		w->n1 += __builtin_popcountll(w->bits[i]);
+	return 0;
+}
+
+static void *enc_worker(void *data)
+{
+	enc_worker_t *w = (enc_worker_t*)data;
+	const rld_t *e0 = w->e0, *e1 = w->e1;
+	const uint64_t *bits = w->bits;
+	uint64_t i, k = 1;
+	rlditr_t itr, itr0, itr1;
+	int last;
+
+	w->e = rld_init(e0->asize, e0->sbits);
+	rld_itr_init(w->e, &itr, 0);
+	if (w->beg - w->n1 < e0->mcnt[0]) rld_itr_seek(e0, &itr0, w->beg - w->n1);
+	if (w->n1 < e1->mcnt[0]) rld_itr_seek(e1, &itr1, w->n1);
+	last = bits[w->beg>>6]&1;
+	for (i = w->beg + 1; i < w->end; ++i) {
+		int c = bits[i>>6]>>(i&0x3f)&1;
+		if (c != last) {
+			if (last == 0) rld_dec_enc(w->e, &itr, e0, &itr0, k, 0);
+			else rld_dec_enc(w->e, &itr, e1, &itr1, k, 0);
+			last = c; k = 1;
+		} else ++k;
+	}
+	if (last == 0) rld_dec_enc(w->e, &itr, e0, &itr0, k, 0);
+	else rld_dec_enc(w->e, &itr, e1, &itr1, k, 0);
+	rld_enc_finish_mt(w->e, &itr, 0);
+	return 0;
+}
+
+static rld_t *fm_merge_mt(rld_t *e0, rld_t *e1, const uint64_t *bits, int n_threads)
+{
+	uint64_t n = e0->mcnt[0] + e1->mcnt[0], step, n1 = 0;
+	pthread_t *tid;
+	pthread_attr_t attr;
+	enc_worker_t *w;
+	rld_t **parts, *e;
+	int j;
+
+	step = (n / n_threads + 63) >> 6 << 6;
+	tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	w = (enc_worker_t*)calloc(n_threads, sizeof(enc_worker_t));
+	parts = (rld_t**)calloc(n_threads, sizeof(void*));
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (j = 0; j < n_threads; ++j) {
+		w[j].e0 = e0, w[j].e1 = e1, w[j].bits = bits;
+		w[j].beg = step * j < n? step * j : n;
+		w[j].end = j == n_threads - 1 || step * (j + 1) > n? n : step * (j + 1);
+		pthread_create(&tid[j], &attr, count_worker, w + j);
+	}
+	for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0);
+	for (j = 0; j < n_threads; ++j) { // n1 of a segment is the number of 1 bits before it
+		uint64_t x = w[j].n1;
+		w[j].n1 = n1, n1 += x;
+	}
+	assert(n1 == e1->mcnt[0]);
+	for (j = 0; j < n_threads; ++j)
+		if (w[j].beg < w[j].end) pthread_create(&tid[j], &attr, enc_worker, w + j);
+	for (j = 0; j < n_threads; ++j)
+		if (w[j].beg < w[j].end) pthread_join(tid[j], 0);
+	for (j = 0; j < n_threads; ++j) parts[j] = w[j].e? w[j].e : rld_init(e0->asize, e0->sbits);
+	rld_destroy(e0); rld_destroy(e1);
+	e = rld_join(n_threads, parts, n_threads);
+	free(parts); free(w); free(tid);
+	return e;
+}
+
 rld_t *fm_merge(rld_t *e0, rld_t *e1, int n_threads)
 {
 	uint64_t i, n = e0->mcnt[0] + e1->mcnt[0], *bits;
@@ -105,8 +246,15 @@ rld_t *fm_merge(rld_t *e0, rld_t *e1, int n_threads)
 
 	// compute the gap array
 	bits = fm_compute_gap_bits(e0, e1, n_threads);
-	free(e0->frame); free(e1->frame); // deallocate the rank indexes of e0 and e1; they are not needed any more
-	e0->frame = e1->frame = 0;
+	if (n_threads > (int64_t)(n >> 20) + 1) n_threads = (n >> 20) + 1; // at least 1M symbols per segment
+	if (n_threads > 1) { // encode segments in parallel; e0 and e1 are kept in memory until the end
+		e = fm_merge_mt(e0, e1, bits, n_threads);
+		free(bits);
+		return e;
+	}
+	// deallocate the rank indexes and the streamed chunks of e0 and e1, unless they are memory mapped
+	if (!e0->mem) free(e0->frame), e0->frame = 0;
+	if (!e1->mem) free(e1->frame), e1->frame = 0;
 	// initialize the FM-index to be returned, and all the three iterators
 	e = rld_init(e0->asize, e0->sbits);
 	rld_itr_init(e, &itr, 0);
@@ -118,24 +266,41 @@ rld_t *fm_merge(rld_t *e0, rld_t *e1, int n_threads)
 		for (i = 1; i < n; ++i) {
 			int c = bits[i>>6]>>(i&0x3f)&1;
 			if (c != last) {
-				if (last == 0) rld_dec_enc(e, &itr, e0, &itr0, k);
-				else rld_dec_enc(e, &itr, e1, &itr1, k);
+				if (last == 0) rld_dec_enc(e, &itr, e0, &itr0, k, !e0->mem);
+				else rld_dec_enc(e, &itr, e1, &itr1, k, !e1->mem);
 				last = c; k = 1;
 			} else ++k;
 		}
 		if (k) {
-			if (last == 0) rld_dec_enc(e, &itr, e0, &itr0, k);
-			else rld_dec_enc(e, &itr, e1, &itr1, k);
+			if (last == 0) rld_dec_enc(e, &itr, e0, &itr0, k, !e0->mem);
+			else rld_dec_enc(e, &itr, e1, &itr1, k, !e1->mem);
 		}
 	}
 	// finalize the merge
 	assert(itr0.l == 0 && itr1.l == 0); // both e0 and e1 stream should be finished
 	free(bits);
 	rld_destroy(e0); rld_destroy(e1);
-	rld_enc_finish(e, &itr);
+	rld_enc_finish_mt(e, &itr, n_threads);
 	return e;
 }
 
+static void merge_run(int n, void *w, size_t size, void *(*func)(void*))
+{
+	pthread_t *tid;
+	pthread_attr_t attr;
+	int j;
+	if (n == 1) {
+		func(w);
+		return;
+	}
+	tid = (pthread_t*)calloc(n, sizeof(pthread_t));
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (j = 0; j < n; ++j) pthread_create(&tid[j], &attr, func, (char*)w + size * j);
+	for (j = 0; j < n; ++j) pthread_join(tid[j], 0);
+	free(tid);
+}
+
 /**********************************
  * Append a string to an FM-index *
  **********************************/
@@ -153,26 +318,158 @@ rld_t *fm_merge_from_SA(rld_t *e0, int len, const uint8_t *T, const int *SA, con
 	rld_itr_init(e0, &itr0, 0);
 	for (i = 0; i < len; ++i) {
 		if (rank_l[i] != last) {
-			rld_dec_enc(e, &itr, e0, &itr0, rank_l[i] - last);
+			rld_dec_enc(e, &itr, e0, &itr0, rank_l[i] - last, 1);
 			last = rank_l[i];
 		}
 		rld_enc(e, &itr, 1, SA[i]? T[SA[i]-1] : 0);
 	}
 	if (last != e0->mcnt[0] - 1)
-		rld_dec_enc(e, &itr, e0, &itr0, e0->mcnt[0] - 1 - last);
+		rld_dec_enc(e, &itr, e0, &itr0, e0->mcnt[0] - 1 - last, 1);
 	rld_destroy(e0);
 	rld_enc_finish(e, &itr);
 	return e;
 }
 
-rld_t *fm_append(rld_t *e0, int len, const uint8_t *T)
+/* The rank of each suffix of T among the suffixes of e0 is computed by an LF
+ * chain from the sentinel of each sequence. Chains are independent, so T is
+ * split at sentinels into one segment per thread. A segment takes its own
+ * slots in each bucket of rank_l given by the symbol counts of the earlier
+ * segments; the order in a bucket does not matter as buckets are sorted later
+ * and the sentinel bucket holds equal ranks. In a segment, FM_BATCH chains are
+ * interleaved such that the rank queries can be prefetched. */
+
+typedef struct {
+	const rld_t *e0;
+	const uint8_t *T;
+	int beg, end, x, *p; // segment [beg,end), ended with a sentinel; x: next sequence; p[c]: next slot in bucket c
+	uint64_t *rank_l;
+} app_worker_t;
+
+static inline int app_next(app_worker_t *w, int *k, int *a, uint64_t *i)
+{ // start the chain of the next non-empty sequence, which goes from T[*k] down to T[*a]
+	do {
+		if (w->x == w->end) return 0;
+		*a = w->x;
+		while (w->T[w->x]) ++w->x;
+		w->rank_l[w->p[0]++] = *i = w->e0->mcnt[1] - 1; // the sentinel
+		*k = w->x++ - 1;
+	} while (*k < *a);
+	return 1;
+}
+
+static void *app_worker(void *data)
+{
+	app_worker_t *w = (app_worker_t*)data;
+	const rld_t *e0 = w->e0;
+	uint64_t oi[6], i[FM_BATCH];
+	int j, n, k[FM_BATCH], a[FM_BATCH];
+
+	w->x = w->beg;
+	for (n = 0; n < FM_BATCH && app_next(w, &k[n], &a[n], &i[n]); ++n);
+	while (n) {
+		for (j = 0; j < n; ++j) rld_prefetch_frame(e0, i[j]);
+		for (j = 0; j < n; ++j) rld_prefetch_blk(e0, i[j]);
+		for (j = 0; j < n; ++j) {
+			int c = w->T[k[j]--];
+			rld_rank1a(e0, i[j], oi);
+			w->rank_l[w->p[c]++] = i[j] = e0->cnt[c] + oi[c] - 1;
+		}
+		for (j = 0; j < n; ++j) { // replace finished chains
+			if (k[j] >= a[j] || app_next(w, &k[j], &a[j], &i[j])) continue;
+			--n;
+			k[j] = k[n], a[j] = a[n], i[j] = i[n];
+			--j; // check the moved chain
+		}
+	}
+	return 0;
+}
+
+/* As there are only asize-1 buckets to sort, a large bucket is first
+ * partitioned in place into n_threads pieces of increasing values, with the
+ * splitters taken from a sorted sample. The pieces of all the buckets are
+ * then sorted independently, such that all the threads are used. */
+
+#define SORT_MIN_PIECE 0x10000
+#define SORT_N_SAMPLE  64 // samples per piece
+
+typedef struct {
+	int n_pieces, n_jobs, *next;
+	const int *C;
+	uint64_t *rank_l;
+	int64_t *off; // piece j goes from off[j] to off[j+1]; bucket c starts at off[(c-1)*n_pieces]
+} sort_worker_t;
+
+static inline int sort_piece(const uint64_t *sp, int n, uint64_t v) // number of splitters below v
 {
-	int c, k, *C, *p, *SA;
-	uint64_t i, *oi, *rank_l;
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+		if (sp[mid] < v) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static void sort_split(uint64_t *a, int64_t n, int m, int64_t beg, int64_t *off)
+{ // partition a[0..n) into m pieces; piece j starts at off[j], shifted by beg
+	uint64_t *sp, v, t;
+	int64_t i, *head, n_sp;
+	int j, p;
+	if (m <= 1 || n < (int64_t)m * SORT_MIN_PIECE) { // a single piece; the rest are empty
+		for (j = 0; j < m; ++j) off[j] = j? beg + n : beg;
+		return;
+	}
+	for (j = 0; j < m; ++j) off[j] = beg;
+	n_sp = (int64_t)m * SORT_N_SAMPLE;
+	sp = (uint64_t*)malloc((size_t)n_sp * 8);
+	for (i = 0; i < n_sp; ++i) sp[i] = a[n * i / n_sp];
+	ks_introsort_uint64_t(n_sp, sp);
+	for (j = 0; j < m - 1; ++j) sp[j] = sp[(j + 1) * SORT_N_SAMPLE]; // the m-1 splitters
+	head = (int64_t*)calloc(m * 2 + 1, 8); // head[j]: next slot in piece j; head[m+1+j]: end of piece j
+	for (i = 0; i < n; ++i) ++head[sort_piece(sp, m - 1, a[i]) + 1];
+	for (j = 1; j <= m; ++j) head[j] += head[j-1];
+	for (j = 0; j < m; ++j) off[j] += head[j], head[m+1+j] = head[j+1];
+	for (j = 0; j < m; ++j) { // move each value to the next free slot of its piece, in cycles
+		while (head[j] < head[m+1+j]) {
+			v = a[head[j]];
+			for (p = sort_piece(sp, m - 1, v); p != j; p = sort_piece(sp, m - 1, v))
+				t = a[head[p]], a[head[p]++] = v, v = t;
+			a[head[j]++] = v;
+		}
+	}
+	free(head); free(sp);
+}
+
+static void *split_worker(void *data)
+{
+	sort_worker_t *w = (sort_worker_t*)data;
+	int c, asize = w->n_jobs / w->n_pieces + 1;
+	while ((c = __sync_fetch_and_add(w->next, 1)) < asize) // do not sort the sentinel bucket
+		sort_split(w->rank_l + w->C[c], w->C[c+1] - w->C[c], w->n_pieces, w->C[c], w->off + (c - 1) * w->n_pieces);
+	return 0;
+}
+
+static void *sort_worker(void *data)
+{
+	sort_worker_t *w = (sort_worker_t*)data;
+	int k;
+	while ((k = __sync_fetch_and_add(w->next, 1)) < w->n_jobs)
+		ks_introsort_uint64_t(w->off[k+1] - w->off[k], w->rank_l + w->off[k]);
+	return 0;
+}
+
+rld_t *fm_append_mt(rld_t *e0, int len, const uint8_t *T, int n_threads)
+{
+	int c, j, k, next = 1, *C, *SA;
+	int64_t *off;
+	uint64_t *rank_l;
 	uint32_t *ws;
+	app_worker_t *w;
+	sort_worker_t *sw;
 	rld_t *e;
 
 	assert(T[len-1] == 0); // must be ended with a sentinel
+	if (n_threads < 1) n_threads = 1;
 	C = alloca(sizeof(int) * (e0->asize + 1));
 	for (c = 0; c <= e0->asize; ++c) C[c] = 0;
 	for (k = 0; k < len; ++k) ++C[T[k] + 1]; // marginal count
@@ -183,27 +480,48 @@ rld_t *fm_append(rld_t *e0, int len, const uint8_t *T)
 	SA = (int*)ws + 2 * (len + 1);
 	// construct the suffix array
 	ksa_sa(T, (int*)SA, len, e0->asize);
-	// grab some memory from the stack
-	p = alloca(sizeof(int) * e0->asize);
-	oi = alloca(8 * e0->asize);
-	// initialize the position array
-	for (c = 0; c < e0->asize; ++c) p[c] = C[c+1] - 1; // point to the last element of each bucket
-	// put the last sentinel 
-	i = e0->mcnt[1] - 1;
-	rank_l[p[0]--] = i;
-	// compute the rank of long suffixes
-	for (k = len - 2; k >= 0; --k) {
-		if ((c = T[k]) != 0) {
-			rld_rank1a(e0, i, oi);
-			i = e0->cnt[c] + oi[c] - 1;
-		} else i = e0->mcnt[1] - 1;
-		rank_l[p[c]--] = i;
+	// split T at sentinels and give each segment its slots in the buckets
+	w = (app_worker_t*)calloc(n_threads, sizeof(app_worker_t));
+	for (j = 0, k = 0; j < n_threads; ++j) {
+		w[j].e0 = e0, w[j].T = T, w[j].rank_l = rank_l;
+		w[j].p = (int*)calloc(e0->asize, sizeof(int));
+		w[j].beg = k;
+		if (j < n_threads - 1) {
+			k = k > (int64_t)len * (j + 1) / n_threads? k : (int64_t)len * (j + 1) / n_threads;
+			while (k < len && T[k]) ++k;
+			k = k < len? k + 1 : len;
+		} else k = len;
+		w[j].end = k;
 	}
+	for (j = 0; j < n_threads; ++j) // count the symbols in each segment
+		for (k = w[j].beg; k < w[j].end; ++k) ++w[j].p[T[k]];
+	for (c = 0; c < e0->asize; ++c)
+		for (j = 0, k = C[c]; j < n_threads; ++j) {
+			int x = w[j].p[c];
+			w[j].p[c] = k, k += x;
+		}
+	merge_run(n_threads, w, sizeof(app_worker_t), app_worker);
+	for (j = 0; j < n_threads; ++j) free(w[j].p);
+	free(w);
 	// sort the rank of long suffixes
-	for (c = 1; c < e0->asize; ++c) // do not sort the sentinel bucket
-		ks_introsort_uint64_t(C[c+1] - C[c], rank_l + C[c]);
+	sw = (sort_worker_t*)calloc(n_threads, sizeof(sort_worker_t));
+	off = (int64_t*)malloc(((size_t)(e0->asize - 1) * n_threads + 1) * 8);
+	off[(e0->asize - 1) * n_threads] = len;
+	for (j = 0; j < n_threads; ++j) {
+		sw[j].n_pieces = n_threads, sw[j].n_jobs = (e0->asize - 1) * n_threads;
+		sw[j].next = &next, sw[j].C = C, sw[j].rank_l = rank_l, sw[j].off = off;
+	}
+	merge_run(n_threads < e0->asize - 1? n_threads : e0->asize - 1, sw, sizeof(sort_worker_t), split_worker);
+	next = 0;
+	merge_run(n_threads, sw, sizeof(sort_worker_t), sort_worker);
+	free(sw); free(off);
 	// merge to e0; e0 will be deallocated
 	e = fm_merge_from_SA(e0, len, T, SA, (int64_t*)rank_l);
 	free(ws);
 	return e;
 }
+
+rld_t *fm_append(rld_t *e0, int len, const uint8_t *T)
+{
+	return fm_append_mt(e0, len, T, 1);
+}
@@ -5,7 +5,10 @@
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include "rld.h"
 #ifndef _NO_UTILS_H
 #include "utils.h"
@@ -84,11 +87,12 @@ void rld_destroy(rld_t *e)
 	if (e == 0) return;
 	if (e->mem) {
 		close(e->fd);
-		munmap(e->mem, rld_file_size(e));
+		munmap(e->mem, e->mem_size);
 	} else {
 		for (i = 0; i < e->n; ++i) free(e->z[i]);
 		free(e->frame);
 	}
+	free(e->fast); free(e->fsuper);
 	free(e->z); free(e->cnt); free(e->mcnt); free(e);
 }
 
@@ -183,36 +187,126 @@ int rld_enc(rld_t *e, rlditr_t *itr, int64_t l, uint8_t c)
 	return 0;
 }
 
-void rld_rank_index(rld_t *e)
+static inline void rld_add_hdr(const rld_t *e, const uint64_t *p, uint64_t *cnt) // add the counts in the block header
 {
-	uint64_t last, n_blks, i, k, *cnt;
 	int j;
+	if (rld_size_bit(*p)) { // 32-bit count
+		const uint32_t *q = (const uint32_t*)p;
+		for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
+	} else { // 16-bit count
+		const uint16_t *q = (const uint16_t*)p;
+		for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
+	}
+}
+
+/* Frame k keeps the last block starting before symbol k<<ibits. The blocks
+ * are split into n_threads ranges. Each range first sums up its block
+ * headers; after a prefix sum, the ranges fill the frames independently. A
+ * range does not write the frame it shares with the first block of the next
+ * range, which is written by the next range. */
+
+typedef struct {
+	rld_t *e;
+	uint64_t beg, end; // block range [beg,end), in words
+	uint64_t *cnt; // counts before the range; asize elements
+	uint64_t next_k, k; // first frame of the next range; last frame of this range
+} rldidx_worker_t;
+
+static void *rld_sum_hdr_worker(void *data)
+{
+	rldidx_worker_t *w = (rldidx_worker_t*)data;
+	uint64_t i;
+	for (i = w->beg; i < w->end; i += w->e->ssize)
+		rld_add_hdr(w->e, rld_seek_blk(w->e, i), w->cnt);
+	return 0;
+}
+
+static void *rld_frame_worker(void *data)
+{
+	rldidx_worker_t *w = (rldidx_worker_t*)data;
+	rld_t *e = w->e;
+	uint64_t i, k = 1, *cnt = w->cnt;
+	int j;
+	for (i = w->beg; i < w->end; i += e->ssize) {
+		uint64_t sum;
+		rld_add_hdr(e, rld_seek_blk(e, i), cnt);
+		for (j = 0, sum = 0; j < e->asize; ++j) sum += cnt[j];
+		if (sum >= k<<e->ibits) k = (sum >> e->ibits) + 1;
+		if (k < e->n_frames && k != w->next_k) {
+			uint64_t x = k * e->asize1;
+			e->frame[x] = i;
+			for (j = 0; j < e->asize; ++j) e->frame[x + j + 1] = cnt[j];
+		}
+	}
+	w->k = k;
+	return 0;
+}
+
+static void rld_run_workers(int n, rldidx_worker_t *w, void *(*func)(void*))
+{
+	pthread_t *tid;
+	pthread_attr_t attr;
+	int t;
+	if (n == 1) {
+		func(w);
+		return;
+	}
+	tid = (pthread_t*)calloc(n, sizeof(pthread_t));
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (t = 0; t < n; ++t) pthread_create(&tid[t], &attr, func, w + t);
+	for (t = 0; t < n; ++t) pthread_join(tid[t], 0);
+	free(tid);
+}
+
+void rld_rank_index_mt(rld_t *e, int n_threads)
+{
+	uint64_t last, n_blks, blk_per_thread, k;
+	rldidx_worker_t *w;
+	int t, j;
 
 	n_blks = e->n_bytes * 8 / 64 / e->ssize + 1;
 	last = rld_last_blk(e);
-	cnt = alloca(e->asize * 8);
 	e->ibits = ilog2(e->mcnt[0] / n_blks) + RLD_IBITS_PLUS;
 	e->n_frames = ((e->mcnt[0] + (1ll<<e->ibits) - 1) >> e->ibits) + 1;
 	e->frame = xcalloc(e->n_frames * e->asize1, 8);
 	e->frame[0] = 0;
-	for (j = 0; j < e->asize; ++j) cnt[j] = 0;
-	for (i = e->ssize, k = 1; i <= last; i += e->ssize) {
-		uint64_t sum, *p = rld_seek_blk(e, i);
-		if (rld_size_bit(*p)) { // 32-bit count
-			uint32_t *q = (uint32_t*)p;
-			for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
-		} else { // 16-bit count
-			uint16_t *q = (uint16_t*)p;
-			for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
+	// split blocks [ssize,last] into ranges; n_threads is reduced for small indices
+	n_blks = last >> e->sbits;
+	if (n_threads < 1) n_threads = 1;
+	if ((uint64_t)n_threads > (n_blks >> 12) + 1) n_threads = (n_blks >> 12) + 1;
+	blk_per_thread = (n_blks + n_threads - 1) / n_threads;
+	w = (rldidx_worker_t*)calloc(n_threads, sizeof(rldidx_worker_t));
+	for (t = 0; t < n_threads; ++t) {
+		w[t].e = e;
+		w[t].cnt = (uint64_t*)calloc(e->asize, 8);
+		w[t].beg = ((uint64_t)t * blk_per_thread + 1) << e->sbits;
+		w[t].end = t == n_threads - 1? last + e->ssize : ((uint64_t)(t + 1) * blk_per_thread + 1) << e->sbits;
+		if (w[t].beg > w[t].end) w[t].beg = w[t].end;
+		w[t].next_k = (uint64_t)-1;
+	}
+	if (n_threads > 1) { // prefix sum of the counts
+		rld_run_workers(n_threads, w, rld_sum_hdr_worker);
+		for (t = n_threads - 1; t > 0; --t) { // shift: w[t].cnt keeps the counts before range t
+			for (j = 0; j < e->asize; ++j) w[t].cnt[j] = w[t-1].cnt[j];
 		}
-		for (j = 0, sum = 0; j < e->asize; ++j) sum += cnt[j];
-		while (sum >= k<<e->ibits) ++k;
-		if (k < e->n_frames) {
-			uint64_t x = k * e->asize1;
-			e->frame[x] = i;
-			for (j = 0; j < e->asize; ++j) e->frame[x + j + 1] = cnt[j];
+		for (j = 0; j < e->asize; ++j) w[0].cnt[j] = 0;
+		for (t = 1; t < n_threads; ++t)
+			for (j = 0; j < e->asize; ++j) w[t].cnt[j] += w[t-1].cnt[j];
+		for (t = 0; t < n_threads - 1; ++t) { // the first frame of the next range
+			uint64_t *cnt = alloca(e->asize * 8), sum = 0;
+			if (w[t+1].beg == w[t+1].end) continue;
+			memcpy(cnt, w[t+1].cnt, e->asize * 8);
+			rld_add_hdr(e, rld_seek_blk(e, w[t+1].beg), cnt);
+			for (j = 0; j < e->asize; ++j) sum += cnt[j];
+			w[t].next_k = (sum >> e->ibits) + 1;
 		}
 	}
+	rld_run_workers(n_threads, w, rld_frame_worker);
+	for (t = n_threads - 1; t > 0 && w[t].beg == w[t].end; --t);
+	k = w[t].k;
+	for (t = 0; t < n_threads; ++t) free(w[t].cnt);
+	free(w);
 	assert(k >= e->n_frames - 1);
 	for (k = 1; k < e->n_frames; ++k) { // fill zero cells
 		uint64_t x = k * e->asize1;
@@ -223,7 +317,12 @@ void rld_rank_index(rld_t *e)
 	}
 }
 
-uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr)
+void rld_rank_index(rld_t *e)
+{
+	rld_rank_index_mt(e, 1);
+}
+
+uint64_t rld_enc_finish_mt(rld_t *e, rlditr_t *itr, int n_threads)
 {
 	int i;
 	if (itr->l) rld_enc1(e, itr, itr->l, itr->c);
@@ -231,81 +330,433 @@ uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr)
 	e->n_bytes = (((uint64_t)(e->n - 1) * RLD_LSIZE) + (itr->p - *itr->i)) * 8;
 	// recompute e->cnt as the accumulative count; e->mcnt[] keeps the marginal counts
 	for (e->cnt[0] = 0, i = 1; i <= e->asize; ++i) e->cnt[i] += e->cnt[i - 1];
-	rld_rank_index(e);
+	if (n_threads > 0) rld_rank_index_mt(e, n_threads);
 	return e->n_bytes;
 }
 
+uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr)
+{
+	return rld_enc_finish_mt(e, itr, 1);
+}
+
+/* Segments of a BWT can be encoded independently and then joined. Blocks are
+ * copied as they are, except that the header of the first block of a part is
+ * set to the counts of the last block of the previous part. An empty block is
+ * inserted where a copied block would fall on the last block of a chunk, which
+ * is one word shorter, or where the first block of a part has a 16-bit header
+ * but needs a 32-bit one. The header of the block after an empty block is
+ * zero. Decoding and rank skip empty blocks. */
+
+static inline void rld_get_hdr(const rld_t *e, const uint64_t *p, uint64_t *cnt) // cnt[0] is the total
+{
+	int j;
+	if (rld_size_bit(*p)) {
+		const uint32_t *q = (const uint32_t*)p;
+		for (j = 0; j <= e->asize; ++j) cnt[j] = q[j];
+		cnt[0] &= 0x7fffffff;
+	} else {
+		const uint16_t *q = (const uint16_t*)p;
+		for (j = 0; j <= e->asize; ++j) cnt[j] = q[j];
+	}
+}
+
+static inline void rld_set_hdr(const rld_t *e, uint64_t *p, const uint64_t *cnt, int size_bit)
+{
+	int j;
+	if (size_bit) {
+		uint32_t *q = (uint32_t*)p;
+		for (j = 0; j <= e->asize; ++j) q[j] = cnt[j];
+		*q |= 1u<<31;
+	} else {
+		uint16_t *q = (uint16_t*)p;
+		for (j = 0; j <= e->asize; ++j) q[j] = cnt[j];
+	}
+}
+
+static uint64_t *rld_join_blk(rld_t *e, uint64_t k) // allocate the chunk if needed
+{
+	if (k >> RLD_LBITS == (uint64_t)e->n) {
+		++e->n;
+		e->z = realloc(e->z, e->n * sizeof(void*));
+		e->z[e->n - 1] = xcalloc(RLD_LSIZE, 8);
+	}
+	return rld_seek_blk(e, k);
+}
+
+rld_t *rld_join(int n, rld_t **parts, int n_threads)
+{
+	rld_t *e;
+	uint64_t k = 0, *hdr;
+	int i, j;
+
+	for (i = j = 0; i < n; ++i) // drop empty parts
+		if (parts[i]->mcnt[0] || (i == n - 1 && j == 0)) parts[j++] = parts[i];
+		else rld_destroy(parts[i]);
+	if ((n = j) == 1) {
+		rld_rank_index_mt(parts[0], n_threads);
+		return parts[0];
+	}
+	e = rld_init(parts[0]->asize, parts[0]->sbits);
+	hdr = alloca(e->asize1 * 8);
+	for (i = 0; i < n; ++i) {
+		rld_t *p = parts[i];
+		uint64_t b = 0, last = rld_last_blk(p);
+		while (b < last) {
+			uint64_t *src = rld_seek_blk(p, b), m, x;
+			int patch = (b == 0 && i > 0);
+			while ((k & RLD_LMASK) == RLD_LSIZE - e->ssize || (patch && hdr[0] >= 0x8000 && !rld_size_bit(*src))) {
+				if (!patch) rld_get_hdr(p, src, hdr), patch = 1;
+				rld_set_hdr(e, rld_join_blk(e, k), hdr, hdr[0] >= 0x8000);
+				memset(hdr, 0, e->asize1 * 8);
+				k += e->ssize;
+			}
+			m = last - b; // copy blocks up to the end of the source chunk or the last block of the destination chunk
+			if ((x = RLD_LSIZE - (b & RLD_LMASK)) < m) m = x;
+			if ((x = RLD_LSIZE - e->ssize - (k & RLD_LMASK)) < m) m = x;
+			memcpy(rld_join_blk(e, k), src, m * 8);
+			if (patch) rld_set_hdr(e, rld_seek_blk(e, k), hdr, rld_size_bit(*src));
+			b += m, k += m;
+		}
+		rld_get_hdr(p, rld_seek_blk(p, last), hdr);
+		for (j = 0; j <= e->asize; ++j) e->mcnt[j] += p->mcnt[j];
+		rld_destroy(p);
+	}
+	rld_set_hdr(e, rld_join_blk(e, k), hdr, hdr[0] >= 0x8000); // the last block
+	e->n_bytes = (k + e->offset0[hdr[0] >= 0x8000]) * 8;
+	for (e->cnt[0] = 0, j = 1; j <= e->asize; ++j) e->cnt[j] = e->cnt[j-1] + e->mcnt[j];
+	rld_rank_index_mt(e, n_threads);
+	return e;
+}
+
+/* When itr0 is at the end of a block, the following blocks of e0 are copied
+ * as long as they hold no more than k symbols in total. The current block of
+ * e is closed first and the header of the first copied block is set to the
+ * counts of the closed block. The copy stops at the last block of a chunk in
+ * e, or if the first copied block has a 16-bit header but needs a 32-bit one.
+ * Both iterators are left at the end of the last copied block. Returns the
+ * number of symbols still to be copied. */
+int64_t rld_copy_blks(rld_t *e, rlditr_t *itr, const rld_t *e0, rlditr_t *itr0, int64_t k, int is_free)
+{
+	uint64_t *hdr, *dcnt, *q, *r, **i0;
+	uint64_t last = rld_last_blk(e0);
+	int j, is_new;
+	hdr = alloca(e->asize1 * 8);
+	dcnt = alloca(e->asize1 * 8);
+	for (;;) {
+		i0 = itr0->i;
+		is_new = (itr0->shead - *i0 == RLD_LSIZE - e0->ssize); // the next block is in the next chunk
+		q = is_new? i0[1] : itr0->shead + e0->ssize;
+		if (q == rld_seek_blk(e0, last)) break;
+		r = q - i0[is_new] == RLD_LSIZE - e0->ssize? i0[is_new + 1] : q + e0->ssize;
+		rld_get_hdr(e0, r, hdr); // the counts in block q
+		if ((int64_t)hdr[0] > k) break;
+		if (itr->l) { // flush the pending run
+			rld_enc1(e, itr, itr->l, itr->c);
+			itr->l = 0, itr->c = -1;
+		}
+		if (itr->r != 64 || itr->p != itr->shead + e->offset0[rld_size_bit(*itr->shead)])
+			enc_next_block(e, itr); // the current block of e is not empty
+		if (itr->shead - *itr->i == RLD_LSIZE - e->ssize) break;
+		rld_get_hdr(e, itr->shead, dcnt); // the counts in the previous block
+		if (dcnt[0] >= 0x8000 && !rld_size_bit(*q)) break;
+		memcpy(itr->shead, q, e->ssize * 8);
+		rld_set_hdr(e, itr->shead, dcnt, rld_size_bit(*q));
+		for (j = 0; j <= e->asize; ++j) e->cnt[j] += hdr[j];
+		k -= hdr[0];
+		itr->p = itr->stail, itr->r = 0; // the block is full
+		if (is_new) {
+			if (is_free) {
+				free(*i0); *i0 = 0;
+			}
+			++itr0->i;
+		}
+		itr0->shead = q;
+		itr0->stail = rld_get_stail(e0, itr0);
+		itr0->p = itr0->stail, itr0->r = 1; // the last bit of a block is never used
+	}
+	return k;
+}
+
 /*****************
  * Save and load *
  *****************/
 
-int rld_dump(const rld_t *e, const char *fn)
+/* An RLD\3 file starts with a 4096-byte header: the magic, asize<<16|sbits,
+ * the number of sections, a reserved word, a table of contents and the
+ * checksum of all the preceding header bytes. Each TOC entry is a 32-byte
+ * {type, log2 alignment, offset, size, checksum}. Sections are aligned to
+ * 2MB if they are at least 2MB in size, or to 4KB otherwise, such that
+ * they can be mapped or advised independently. RLD\3 is only written on
+ * request; RLD\2 remains the default such that older binaries can read the
+ * output. */
+
+#define RLD3_HDR   4096
+#define RLD3_N_SEC 3
+
+#define RLD3_CNT 0 // n_bytes, n_frames and the marginal counts
+#define RLD3_BLK 1 // delta-encoded blocks
+#define RLD3_FRM 2 // frames
+
+typedef struct {
+	uint32_t type, abits;
+	uint64_t off, size, sum;
+} rldsec_t;
+
+#define rld_align(x, b) (((x) + (1ULL<<(b)) - 1) >> (b) << (b))
+
+static inline uint64_t rld_cksum(uint64_t h, const uint64_t *p, uint64_t n) // FNV-1a on 64-bit words
 {
-	uint64_t k = 0;
+	uint64_t i;
+	for (i = 0; i < n; ++i)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+#define RLD_CKSUM0 0xcbf29ce484222325ULL
+
+static uint64_t rld_cksum_blk(const rld_t *e)
+{
+	uint64_t h = RLD_CKSUM0, k;
+	int i;
+	for (i = 0, k = e->n_bytes / 8; i < e->n - 1; ++i, k -= RLD_LSIZE)
+		h = rld_cksum(h, e->z[i], RLD_LSIZE);
+	return rld_cksum(h, e->z[i], k);
+}
+
+static void rld_pad(FILE *fp, uint64_t n) // leave a hole if the file is seekable
+{
+	static const uint8_t zero[4096];
+	if (n == 0 || fseek(fp, n, SEEK_CUR) == 0) return;
+	for (; n >= 4096; n -= 4096) fwrite(zero, 1, 4096, fp);
+	fwrite(zero, 1, n, fp);
+}
+
+// compute the section layout and fill the header; cnt must hold 2+asize words
+static uint64_t rld_layout_v3(const rld_t *e, rldsec_t *sec, uint64_t *cnt, uint8_t *hdr)
+{
+	uint64_t k, off;
+	uint32_t a[3];
+	int i;
+	cnt[0] = e->n_bytes, cnt[1] = e->n_frames;
+	memcpy(cnt + 2, e->mcnt + 1, e->asize * 8);
+	sec[RLD3_CNT].size = (2 + e->asize) * 8;
+	sec[RLD3_CNT].sum = rld_cksum(RLD_CKSUM0, cnt, 2 + e->asize);
+	sec[RLD3_BLK].size = e->n_bytes;
+	sec[RLD3_BLK].sum = rld_cksum_blk(e);
+	sec[RLD3_FRM].size = e->n_frames * e->asize1 * 8;
+	sec[RLD3_FRM].sum = rld_cksum(RLD_CKSUM0, e->frame, e->n_frames * e->asize1);
+	for (i = 0, off = RLD3_HDR; i < RLD3_N_SEC; ++i) {
+		sec[i].type = i;
+		sec[i].abits = sec[i].size >= 1<<21? 21 : 12;
+		sec[i].off = off = rld_align(off, sec[i].abits);
+		off += sec[i].size;
+	}
+	memset(hdr, 0, RLD3_HDR);
+	memcpy(hdr, "RLD\3", 4);
+	a[0] = e->asize<<16 | e->sbits, a[1] = RLD3_N_SEC, a[2] = 0;
+	memcpy(hdr + 4, a, 12);
+	for (i = 0; i < RLD3_N_SEC; ++i)
+		memcpy(hdr + 16 + i * 32, &sec[i], 32);
+	k = rld_cksum(RLD_CKSUM0, (uint64_t*)hdr, (16 + RLD3_N_SEC * 32) / 8);
+	memcpy(hdr + 16 + RLD3_N_SEC * 32, &k, 8);
+	return off; // the total size
+}
+
+static int rld_write_v3(const rld_t *e, FILE *fp)
+{
+	uint64_t k, *cnt;
+	uint8_t hdr[RLD3_HDR];
+	rldsec_t sec[RLD3_N_SEC];
+	int i;
+	cnt = xcalloc(2 + e->asize, 8);
+	rld_layout_v3(e, sec, cnt, hdr);
+	fwrite(hdr, 1, RLD3_HDR, fp);
+	rld_pad(fp, sec[RLD3_CNT].off - RLD3_HDR);
+	fwrite(cnt, 8, 2 + e->asize, fp);
+	rld_pad(fp, sec[RLD3_BLK].off - (sec[RLD3_CNT].off + sec[RLD3_CNT].size));
+	for (i = 0, k = e->n_bytes / 8; i < e->n - 1; ++i, k -= RLD_LSIZE)
+		fwrite(e->z[i], 8, RLD_LSIZE, fp);
+	fwrite(e->z[i], 8, k, fp);
+	rld_pad(fp, sec[RLD3_FRM].off - (sec[RLD3_BLK].off + sec[RLD3_BLK].size));
+	fwrite(e->frame, 8 * e->asize1, e->n_frames, fp);
+	free(cnt);
+	return 0;
+}
+
+// fill the RLD\2 header, which takes (4+asize)*8 bytes
+static void rld_header_v2(const rld_t *e, uint64_t *hdr)
+{
+	uint32_t a = e->asize<<16 | e->sbits;
+	memcpy(hdr, "RLD\2", 4); // magic
+	memcpy((uint8_t*)hdr + 4, &a, 4); // sbits and asize
+	hdr[1] = 0; // preserve 8 bytes for future uses
+	hdr[2] = e->n_bytes; // n_bytes can always be divided by 8
+	hdr[3] = e->n_frames; // number of frames
+	memcpy(hdr + 4, e->mcnt + 1, e->asize * 8); // the marginal counts
+}
+
+static int rld_write(const rld_t *e, FILE *fp, int ver) // fp is closed
+{
+	uint64_t k, *hdr;
 	int i;
-	uint32_t a;
-	FILE *fp;
-	fp = strcmp(fn, "-")? fopen(fn, "wb") : fdopen(fileno(stdout), "wb");
 	if (fp == 0) return -1;
-	a = e->asize<<16 | e->sbits;
-	fwrite("RLD\2", 1, 4, fp); // write magic
-	fwrite(&a, 4, 1, fp); // write sbits and asize
-	fwrite(&k, 8, 1, fp); // preserve 8 bytes for future uses
-	fwrite(&e->n_bytes, 8, 1, fp); // n_bytes can always be divided by 8
-	fwrite(&e->n_frames, 8, 1, fp); // number of frames
-	fwrite(e->mcnt + 1, 8, e->asize, fp); // write the marginal counts
+	if (ver == 3) {
+		rld_write_v3(e, fp);
+		return fclose(fp) == 0? 0 : -1;
+	}
+	hdr = xcalloc(4 + e->asize, 8);
+	rld_header_v2(e, hdr);
+	fwrite(hdr, 8, 4 + e->asize, fp);
+	free(hdr);
 	for (i = 0, k = e->n_bytes / 8; i < e->n - 1; ++i, k -= RLD_LSIZE)
 		fwrite(e->z[i], 8, RLD_LSIZE, fp);
 	fwrite(e->z[i], 8, k, fp);
 	fwrite(e->frame, 8 * e->asize1, e->n_frames, fp);
-	fclose(fp);
+	return fclose(fp) == 0? 0 : -1;
+}
+
+static int rld_dump_core(const rld_t *e, const char *fn, int ver)
+{
+	return rld_write(e, strcmp(fn, "-")? fopen(fn, "wb") : fdopen(fileno(stdout), "wb"), ver);
+}
+
+int rld_dump(const rld_t *e, const char *fn) { return rld_dump_core(e, fn, 2); }
+int rld_dump_v3(const rld_t *e, const char *fn) { return rld_dump_core(e, fn, 3); }
+
+static void rld_set_cnt(rld_t *e)
+{
+	int i;
+	for (i = 0; i <= e->asize; ++i) e->cnt[i] = e->mcnt[i];
+	for (i = 1; i <= e->asize; ++i) e->cnt[i] += e->cnt[i - 1];
+	e->mcnt[0] = e->cnt[e->asize];
+}
+
+static int rld_skip(FILE *fp, uint64_t n) // fseek() does not work with pipes
+{
+	uint8_t buf[4096];
+	for (; n >= 4096; n -= 4096)
+		if (fread(buf, 1, 4096, fp) != 4096) return -1;
+	return fread(buf, 1, n, fp) == n? 0 : -1;
+}
+
+static rld_t *rld_restore_header_v3(const char *fn, FILE *fp, rldsec_t *sec)
+{
+	uint8_t hdr[RLD3_HDR];
+	uint32_t a[3];
+	uint64_t h, *cnt;
+	rld_t *e;
+	int i;
+	memcpy(hdr, "RLD\3", 4);
+	if (fread(hdr + 4, 1, RLD3_HDR - 4, fp) != RLD3_HDR - 4) goto bad_hdr;
+	memcpy(a, hdr + 4, 12);
+	if (a[1] != RLD3_N_SEC) goto bad_hdr;
+	memcpy(&h, hdr + 16 + RLD3_N_SEC * 32, 8);
+	if (h != rld_cksum(RLD_CKSUM0, (uint64_t*)hdr, (16 + RLD3_N_SEC * 32) / 8)) goto bad_hdr;
+	for (i = 0; i < RLD3_N_SEC; ++i)
+		memcpy(&sec[i], hdr + 16 + i * 32, 32);
+	e = rld_init(a[0]>>16, a[0]&0xffff);
+	if (sec[RLD3_CNT].size != (2 + e->asize) * 8) {
+		rld_destroy(e);
+		goto bad_hdr;
+	}
+	cnt = xmalloc(sec[RLD3_CNT].size);
+	if (rld_skip(fp, sec[RLD3_CNT].off - RLD3_HDR) < 0 || fread(cnt, 8, 2 + e->asize, fp) != 2 + e->asize
+		|| rld_cksum(RLD_CKSUM0, cnt, 2 + e->asize) != sec[RLD3_CNT].sum)
+	{
+		fprintf(stderr, "[E::%s] corrupted counts section in `%s'\n", __func__, fn);
+		free(cnt); rld_destroy(e);
+		return 0;
+	}
+	e->n_bytes = cnt[0], e->n_frames = cnt[1];
+	memcpy(e->mcnt + 1, cnt + 2, e->asize * 8);
+	free(cnt);
+	rld_set_cnt(e);
+	return e;
+
+bad_hdr:
+	fprintf(stderr, "[E::%s] corrupted RLD\\3 header in `%s'\n", __func__, fn);
 	return 0;
 }
 
-static rld_t *rld_restore_header(const char *fn, FILE **_fp)
+/* Read the header. On success, *ver is 2 or 3; for RLD\3, sec[] keeps the TOC
+ * and fp is positioned at the end of the counts section. If the file is the
+ * run-length BWT written by `ropebwt -b', *ver is set to 0; on an unknown
+ * magic, *ver is set to -1. */
+static rld_t *rld_read_header(const char *fn, FILE *fp, int *ver, rldsec_t *sec)
 {
-	FILE *fp;
 	rld_t *e;
 	char magic[4];
 	uint64_t a[3];
-	int32_t i, x;
+	int32_t x;
 
-	if (strcmp(fn, "-") == 0) *_fp = fp = stdin;
-	else if ((*_fp = fp = fopen(fn, "rb")) == 0) return 0;
-	fread(magic, 1, 4, fp);
-	if (strncmp(magic, "RLD\2", 4)) return 0;
+	*ver = 0;
+	if (fread(magic, 1, 4, fp) != 4) return 0;
+	if (strncmp(magic, "RLD\3", 4) == 0) {
+		*ver = 3;
+		return rld_restore_header_v3(fn, fp, sec);
+	}
+	if (strncmp(magic, "RLE\6", 4) == 0) return 0;
+	if (strncmp(magic, "RLD\2", 4)) {
+		fprintf(stderr, "[E::%s] `%s' is not an FM-index: unknown magic\n", __func__, fn);
+		*ver = -1;
+		return 0;
+	}
+	*ver = 2;
 	fread(&x, 4, 1, fp);
 	e = rld_init(x>>16, x&0xffff);
 	fread(a, 8, 3, fp);
 	e->n_bytes = a[1]; e->n_frames = a[2];
 	fread(e->mcnt + 1, 8, e->asize, fp);
-	for (i = 0; i <= e->asize; ++i) e->cnt[i] = e->mcnt[i];
-	for (i = 1; i <= e->asize; ++i) e->cnt[i] += e->cnt[i - 1];
-	e->mcnt[0] = e->cnt[e->asize];
+	rld_set_cnt(e);
 	return e;
 }
 
+static rld_t *rld_restore_header(const char *fn, FILE **_fp, int *ver, rldsec_t *sec)
+{
+	*ver = 0;
+	if (strcmp(fn, "-") == 0) *_fp = stdin;
+	else if ((*_fp = fopen(fn, "rb")) == 0) return 0;
+	return rld_read_header(fn, *_fp, ver, sec);
+}
+
+static rld_t *rld_restore_rle(FILE *fp, int n_threads) // the 4-byte magic has been read
+{
+	uint8_t *buf;
+	int i, l;
+	rlditr_t itr;
+	rld_t *e;
+	buf = malloc(0x10000);
+	e = rld_init(6, 3);
+	rld_itr_init(e, &itr, 0);
+	while ((l = fread(buf, 1, 0x10000, fp)) != 0)
+		for (i = 0; i < l; ++i)
+			if (buf[i]>>3) rld_enc(e, &itr, buf[i]>>3, buf[i]&7);
+	fclose(fp);
+	free(buf);
+	rld_enc_finish_mt(e, &itr, n_threads);
+	return e;
+}
+
+static void rld_set_ibits(rld_t *e)
+{
+	uint64_t n_blks = e->n_bytes * 8 / 64 / e->ssize + 1;
+	e->ibits = ilog2(e->mcnt[0] / n_blks) + RLD_IBITS_PLUS;
+}
+
 rld_t *rld_restore(const char *fn)
 {
 	FILE *fp;
 	rld_t *e;
-	uint64_t k, n_blks;
-	int32_t i;
-
-	if ((e = rld_restore_header(fn, &fp)) == 0) { // then load as plain DNA rle
-		uint8_t *buf;
-		int l;
-		rlditr_t itr;
-		buf = malloc(0x10000);
-		e = rld_init(6, 3);
-		rld_itr_init(e, &itr, 0);
-		while ((l = fread(buf, 1, 0x10000, fp)) != 0)
-			for (i = 0; i < l; ++i)
-				if (buf[i]>>3) rld_enc(e, &itr, buf[i]>>3, buf[i]&7);
-		fclose(fp);
-		free(buf);
-		rld_enc_finish(e, &itr);
-		return e;
+	rldsec_t sec[RLD3_N_SEC];
+	uint64_t k;
+	int32_t i, ver;
+
+	if ((e = rld_restore_header(fn, &fp, &ver, sec)) == 0) {
+		if (fp == 0 || ver != 0) { // failed to open, unknown magic or a corrupted RLD\3 file
+			if (fp && fp != stdin) fclose(fp);
+			return 0;
+		}
+		return rld_restore_rle(fp, 1); // then load as plain DNA rle
 	}
 	if (e->n_bytes / 8 > RLD_LSIZE) { // allocate enough memory
 		e->n = (e->n_bytes / 8 + RLD_LSIZE - 1) / RLD_LSIZE;
@@ -313,38 +764,483 @@ rld_t *rld_restore(const char *fn)
 		for (i = 1; i < e->n; ++i)
 			e->z[i] = xcalloc(RLD_LSIZE, 8);
 	}
+	if (ver == 3) rld_skip(fp, sec[RLD3_BLK].off - (sec[RLD3_CNT].off + sec[RLD3_CNT].size));
 	for (i = 0, k = e->n_bytes / 8; i < e->n - 1; ++i, k -= RLD_LSIZE)
 		fread(e->z[i], 8, RLD_LSIZE, fp);
 	fread(e->z[i], 8, k, fp);
+	if (ver == 3) rld_skip(fp, sec[RLD3_FRM].off - (sec[RLD3_BLK].off + sec[RLD3_BLK].size));
 	e->frame = xmalloc(e->n_frames * e->asize1 * 8);
 	fread(e->frame, 8 * e->asize1, e->n_frames, fp);
 	fclose(fp);
-	n_blks = e->n_bytes * 8 / 64 / e->ssize + 1;
-	e->ibits = ilog2(e->mcnt[0] / n_blks) + RLD_IBITS_PLUS;
+	if (ver == 3 && (rld_cksum_blk(e) != sec[RLD3_BLK].sum || rld_cksum(RLD_CKSUM0, e->frame, e->n_frames * e->asize1) != sec[RLD3_FRM].sum)) {
+		fprintf(stderr, "[E::%s] checksum mismatch in `%s'\n", __func__, fn);
+		rld_destroy(e);
+		return 0;
+	}
+	rld_set_ibits(e);
+	return e;
+}
+
+static void rld_advise(void *p, uint64_t size, int flag)
+{
+	if (size == 0) return;
+#ifdef MADV_HUGEPAGE
+	if (flag & RLD_MAP_HUGEPAGE) madvise(p, size, MADV_HUGEPAGE); // best effort: only honored by some kernels/filesystems
+#endif
+	if (flag & RLD_MAP_WILLNEED) madvise(p, size, MADV_WILLNEED);
+	if (flag & RLD_MAP_POPULATE) {
+#ifdef MADV_POPULATE_READ
+		if (madvise(p, size, MADV_POPULATE_READ) == 0) return;
+#endif
+		{ // fall back to touching every page
+			volatile const uint8_t *q = (const uint8_t*)p;
+			uint64_t i, page = sysconf(_SC_PAGESIZE);
+			uint8_t s = 0;
+			for (i = 0; i < size; i += page) s += q[i];
+			(void)s;
+		}
+	}
+}
+
+// map the index from fd, which is taken over by $e; $e comes from rld_read_header()
+static rld_t *rld_map_fd(rld_t *e, int fd, const char *fn, int ver, const rldsec_t *sec, int flag)
+{
+	uint64_t *z, *f;
+	int i;
+	free(e->z[0]); free(e->z);
+	e->n = (e->n_bytes / 8 + RLD_LSIZE - 1) / RLD_LSIZE;
+	e->z = xcalloc(e->n, sizeof(void*));
+	e->fd = fd;
+	e->mem_size = ver == 3? sec[RLD3_FRM].off + sec[RLD3_FRM].size : rld_file_size(e);
+	e->mem = (uint64_t*)mmap(0, e->mem_size, PROT_READ, MAP_PRIVATE, e->fd, 0);
+	if ((void*)e->mem == MAP_FAILED) {
+		e->mem = 0, e->n = 0, e->frame = 0;
+		close(e->fd);
+		rld_destroy(e);
+		return 0;
+	}
+	if (ver == 3) {
+		z = e->mem + sec[RLD3_BLK].off / 8;
+		f = e->mem + sec[RLD3_FRM].off / 8;
+		rld_advise(z, sec[RLD3_BLK].size, flag & 0xff);
+		rld_advise(f, sec[RLD3_FRM].size, flag >> 8 & 0xff);
+	} else {
+		z = e->mem + (4 + e->asize);
+		f = z + e->n_bytes/8;
+	}
+	for (i = 0; i < e->n; ++i) e->z[i] = z + (size_t)i * RLD_LSIZE;
+	e->frame = f;
+	if (ver == 3 && (((flag & RLD_MAP_VERIFY) && rld_cksum_blk(e) != sec[RLD3_BLK].sum)
+		|| ((flag>>8 & RLD_MAP_VERIFY) && rld_cksum(RLD_CKSUM0, e->frame, e->n_frames * e->asize1) != sec[RLD3_FRM].sum)))
+	{
+		fprintf(stderr, "[E::%s] checksum mismatch in `%s'\n", __func__, fn);
+		rld_destroy(e);
+		return 0;
+	}
+	rld_set_ibits(e);
 	return e;
 }
 
+rld_t *rld_restore_mmap_opt(const char *fn, int flag)
+{
+	FILE *fp;
+	rld_t *e;
+	rldsec_t sec[RLD3_N_SEC];
+	int ver;
+
+	if ((e = rld_restore_header(fn, &fp, &ver, sec)) == 0) {
+		if (fp && fp != stdin) fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	return rld_map_fd(e, open(fn, O_RDONLY), fn, ver, sec, flag);
+}
+
 rld_t *rld_restore_mmap(const char *fn)
+{
+	return rld_restore_mmap_opt(fn, 0);
+}
+
+/*****************
+ * Parallel I/O *
+ *****************/
+
+/* The blocks and the frames are split into RLD_IO_PIECE-byte pieces, which
+ * are read or written with pread()/pwrite() by n_threads threads. Only
+ * regular files are supported; otherwise we fall back to stdio. */
+
+#define RLD_IO_PIECE (1ULL<<23)
+
+typedef struct {
+	uint8_t *p;
+	uint64_t off, len;
+} rldio_t;
+
+typedef struct {
+	int fd, tid, n_threads, is_write, n_jobs, ret;
+	const rldio_t *jobs;
+} rldio_worker_t;
+
+static int rld_io_jobs(const rld_t *e, uint64_t blk_off, uint64_t frm_off, rldio_t **_jobs)
+{
+	int i, n = 0, m = 0;
+	uint64_t k, l, len;
+	rldio_t *jobs = 0;
+	for (i = 0, k = e->n_bytes; i < e->n; ++i, k -= len) {
+		len = k < (uint64_t)RLD_LSIZE * 8? k : (uint64_t)RLD_LSIZE * 8;
+		for (l = 0; l < len; l += RLD_IO_PIECE) {
+			if (n == m) m = m? m<<1 : 16, jobs = realloc(jobs, m * sizeof(rldio_t));
+			jobs[n].p = (uint8_t*)e->z[i] + l;
+			jobs[n].off = blk_off + (uint64_t)i * RLD_LSIZE * 8 + l;
+			jobs[n++].len = len - l < RLD_IO_PIECE? len - l : RLD_IO_PIECE;
+		}
+	}
+	len = e->n_frames * e->asize1 * 8;
+	for (l = 0; l < len; l += RLD_IO_PIECE) {
+		if (n == m) m = m? m<<1 : 16, jobs = realloc(jobs, m * sizeof(rldio_t));
+		jobs[n].p = (uint8_t*)e->frame + l;
+		jobs[n].off = frm_off + l;
+		jobs[n++].len = len - l < RLD_IO_PIECE? len - l : RLD_IO_PIECE;
+	}
+	*_jobs = jobs;
+	return n;
+}
+
+static void *rld_io_worker(void *data)
+{
+	rldio_worker_t *w = (rldio_worker_t*)data;
+	int j;
+	for (j = w->tid; j < w->n_jobs && w->ret == 0; j += w->n_threads) {
+		const rldio_t *q = &w->jobs[j];
+		uint64_t l;
+		ssize_t r;
+		for (l = 0; l < q->len; l += r) {
+			r = w->is_write? pwrite(w->fd, q->p + l, q->len - l, q->off + l) : pread(w->fd, q->p + l, q->len - l, q->off + l);
+			if (r <= 0) {
+				if (r < 0 && errno == EINTR) r = 0;
+				else {
+					w->ret = -1;
+					break;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int rld_io_mt(int fd, int n_jobs, const rldio_t *jobs, int is_write, int n_threads)
+{
+	pthread_t *tid;
+	pthread_attr_t attr;
+	rldio_worker_t *w;
+	int j, ret = 0;
+	if (n_threads > n_jobs) n_threads = n_jobs;
+	if (n_threads < 1) return 0;
+	tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	w = (rldio_worker_t*)calloc(n_threads, sizeof(rldio_worker_t));
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (j = 0; j < n_threads; ++j) {
+		w[j].fd = fd, w[j].jobs = jobs, w[j].n_jobs = n_jobs, w[j].is_write = is_write;
+		w[j].tid = j, w[j].n_threads = n_threads;
+		pthread_create(&tid[j], &attr, rld_io_worker, w + j);
+	}
+	for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0);
+	for (j = 0; j < n_threads; ++j)
+		if (w[j].ret < 0) ret = -1;
+	free(w); free(tid);
+	return ret;
+}
+
+static int rld_is_reg(const char *fn)
+{
+	struct stat st;
+	return strcmp(fn, "-") && stat(fn, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+rld_t *rld_restore_mt(const char *fn, int n_threads)
 {
 	FILE *fp;
 	rld_t *e;
-	int i;
-	int64_t n_blks;
+	rldsec_t sec[RLD3_N_SEC];
+	rldio_t *jobs;
+	uint64_t blk_off, frm_off;
+	int i, ver, fd, n_jobs, ret;
 
-	e = rld_restore_header(fn, &fp);
+	if (n_threads <= 1 || !rld_is_reg(fn)) return rld_restore(fn);
+	if ((e = rld_restore_header(fn, &fp, &ver, sec)) == 0) { // not an FM-index or corrupted; ver==0 for RLE\6
+		if (fp && ver == 0) return rld_restore_rle(fp, n_threads);
+		if (fp) fclose(fp);
+		return 0;
+	}
 	fclose(fp);
-	free(e->z[0]); free(e->z);
-	e->n = (e->n_bytes / 8 + RLD_LSIZE - 1) / RLD_LSIZE;
-	e->z = xcalloc(e->n, sizeof(void*));
-	e->fd = open(fn, O_RDONLY);
-	e->mem = (uint64_t*)mmap(0, rld_file_size(e), PROT_READ, MAP_PRIVATE, e->fd, 0);
-	for (i = 0; i < e->n; ++i) e->z[i] = e->mem + (4 + e->asize) + (size_t)i * RLD_LSIZE;
-	e->frame = e->mem + (4 + e->asize) + e->n_bytes/8;
-	n_blks = e->n_bytes * 8 / 64 / e->ssize + 1;
-	e->ibits = ilog2(e->mcnt[0] / n_blks) + RLD_IBITS_PLUS;
+	if (ver == 3) blk_off = sec[RLD3_BLK].off, frm_off = sec[RLD3_FRM].off;
+	else blk_off = (4 + e->asize) * 8, frm_off = blk_off + e->n_bytes;
+	if (e->n_bytes / 8 > RLD_LSIZE) {
+		e->n = (e->n_bytes / 8 + RLD_LSIZE - 1) / RLD_LSIZE;
+		e->z = realloc(e->z, e->n * sizeof(void*));
+		for (i = 1; i < e->n; ++i)
+			e->z[i] = xmalloc((size_t)RLD_LSIZE * 8);
+	}
+	e->frame = xmalloc(e->n_frames * e->asize1 * 8);
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		rld_destroy(e);
+		return 0;
+	}
+	n_jobs = rld_io_jobs(e, blk_off, frm_off, &jobs);
+	ret = rld_io_mt(fd, n_jobs, jobs, 0, n_threads);
+	close(fd); free(jobs);
+	if (ret == 0 && ver == 3 && (rld_cksum_blk(e) != sec[RLD3_BLK].sum || rld_cksum(RLD_CKSUM0, e->frame, e->n_frames * e->asize1) != sec[RLD3_FRM].sum)) {
+		fprintf(stderr, "[E::%s] checksum mismatch in `%s'\n", __func__, fn);
+		ret = -1;
+	}
+	if (ret < 0) {
+		rld_destroy(e);
+		return 0;
+	}
+	rld_set_ibits(e);
+	return e;
+}
+
+static int rld_dump_mt_core(const rld_t *e, const char *fn, int n_threads, int ver)
+{
+	rldsec_t sec[RLD3_N_SEC];
+	uint8_t hdr[RLD3_HDR];
+	uint64_t *cnt, size, blk_off, frm_off;
+	rldio_t *jobs;
+	int fd, n_jobs, ret = 0;
+	struct stat st;
+
+	if (n_threads <= 1 || strcmp(fn, "-") == 0) return rld_dump_core(e, fn, ver);
+	if ((fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) return -1;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) // e.g. /dev/stdout or a fifo; no pwrite()
+		return rld_write(e, fdopen(fd, "wb"), ver);
+	cnt = xcalloc(4 + e->asize, 8);
+	if (ver == 3) {
+		size = rld_layout_v3(e, sec, cnt, hdr);
+		blk_off = sec[RLD3_BLK].off, frm_off = sec[RLD3_FRM].off;
+		if (ftruncate(fd, size) < 0 || pwrite(fd, hdr, RLD3_HDR, 0) != RLD3_HDR
+			|| pwrite(fd, cnt, sec[RLD3_CNT].size, sec[RLD3_CNT].off) != (ssize_t)sec[RLD3_CNT].size)
+			ret = -1;
+	} else {
+		rld_header_v2(e, cnt);
+		blk_off = (4 + e->asize) * 8, frm_off = blk_off + e->n_bytes;
+		size = frm_off + e->n_frames * e->asize1 * 8;
+		if (ftruncate(fd, size) < 0 || pwrite(fd, cnt, blk_off, 0) != (ssize_t)blk_off)
+			ret = -1;
+	}
+	free(cnt);
+	if (ret == 0) {
+		n_jobs = rld_io_jobs(e, blk_off, frm_off, &jobs);
+		ret = rld_io_mt(fd, n_jobs, jobs, 1, n_threads);
+		free(jobs);
+	}
+	if (close(fd) < 0) ret = -1;
+	return ret;
+}
+
+int rld_dump_mt(const rld_t *e, const char *fn, int n_threads) { return rld_dump_mt_core(e, fn, n_threads, 2); }
+int rld_dump_mt_v3(const rld_t *e, const char *fn, int n_threads) { return rld_dump_mt_core(e, fn, n_threads, 3); }
+
+/*****************
+ * Shared memory *
+ *****************/
+
+/* An index loaded with rld_shm_load() is kept as an RLD\3 image in a POSIX
+ * shared memory object named after the absolute path of the index file. All
+ * processes attaching it share the same physical pages. The magic is written
+ * last, so an object that is still being loaded is not attached. */
+
+static char *rld_shm_name(const char *fn)
+{
+	char *path, *name, *p;
+	if ((path = realpath(fn, 0)) == 0) return 0;
+	name = malloc(strlen(path) + 7);
+	strcat(strcpy(name, "/fermi"), path);
+	for (p = name + 1; *p; ++p)
+		if (*p == '/') *p = ':';
+	free(path);
+	return name;
+}
+
+int rld_shm_load(const char *fn)
+{
+	rld_t *e;
+	rldsec_t sec[RLD3_N_SEC];
+	uint8_t hdr[RLD3_HDR], *mem;
+	uint64_t size, k, *cnt;
+	char *name;
+	int i, fd;
+
+	if ((name = rld_shm_name(fn)) == 0) return -1;
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) { // claim the name before the slow loading
+		int ret = errno == EEXIST? -2 : -1;
+		if (ret == -1) fprintf(stderr, "[E::%s] failed to create `%s': %s\n", __func__, name, strerror(errno));
+		free(name);
+		return ret;
+	}
+	if ((e = rld_restore(fn)) == 0) {
+		shm_unlink(name); close(fd);
+		free(name);
+		return -1;
+	}
+	cnt = xcalloc(2 + e->asize, 8);
+	size = rld_layout_v3(e, sec, cnt, hdr);
+	if (ftruncate(fd, size) < 0 || (mem = (uint8_t*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		shm_unlink(name); close(fd);
+		free(cnt); free(name); rld_destroy(e);
+		return -1;
+	}
+#ifdef MADV_HUGEPAGE
+	madvise(mem, size, MADV_HUGEPAGE); // honored if /sys/kernel/mm/transparent_hugepage/shmem_enabled is "advise"
+#endif
+	memcpy(mem + sec[RLD3_CNT].off, cnt, sec[RLD3_CNT].size);
+	for (i = 0, k = e->n_bytes / 8; i < e->n - 1; ++i, k -= RLD_LSIZE)
+		memcpy(mem + sec[RLD3_BLK].off + (size_t)i * RLD_LSIZE * 8, e->z[i], (size_t)RLD_LSIZE * 8);
+	memcpy(mem + sec[RLD3_BLK].off + (size_t)i * RLD_LSIZE * 8, e->z[i], k * 8);
+	memcpy(mem + sec[RLD3_FRM].off, e->frame, sec[RLD3_FRM].size);
+	memcpy(mem + 4, hdr + 4, RLD3_HDR - 4);
+	__sync_synchronize();
+	memcpy(mem, hdr, 4);
+	munmap(mem, size); close(fd);
+	free(cnt); free(name); rld_destroy(e);
+	return 0;
+}
+
+int rld_shm_unload(const char *fn)
+{
+	char *name;
+	int ret;
+	if ((name = rld_shm_name(fn)) == 0) return -1;
+	ret = shm_unlink(name);
+	free(name);
+	return ret;
+}
+
+rld_t *rld_attach_shm(const char *fn, int flag)
+{
+	rld_t *e;
+	rldsec_t sec[RLD3_N_SEC];
+	struct stat st, st_shm;
+	FILE *fp;
+	char *name, magic[4];
+	int fd, ver;
+
+	if ((name = rld_shm_name(fn)) == 0) return 0;
+	fd = shm_open(name, O_RDONLY, 0);
+	free(name);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st_shm) < 0 || stat(fn, &st) < 0 || st.st_mtime > st_shm.st_mtime) { // the index has been modified since loaded
+		fprintf(stderr, "[W::%s] `%s' is newer than its copy in shared memory; not attached\n", __func__, fn);
+		close(fd);
+		return 0;
+	}
+	if (pread(fd, magic, 4, 0) != 4 || strncmp(magic, "RLD\3", 4)) { // still being loaded
+		close(fd);
+		return 0;
+	}
+	fp = fdopen(dup(fd), "rb");
+	e = rld_read_header(fn, fp, &ver, sec);
+	fclose(fp);
+	if (e == 0 || ver != 3) {
+		rld_destroy(e);
+		close(fd);
+		return 0;
+	}
+	return rld_map_fd(e, fd, fn, ver, sec, flag);
+}
+
+/*****************************
+ * Uncompressed rank index *
+ *****************************/
+
+/* Each 64-byte line keeps six 32-bit symbol counts before the line, relative
+ * to the superblock, followed by RLD_FSYM 4-bit symbols in five words. The
+ * occurrences of a symbol are counted with nibble-wise comparisons and
+ * accumulated in registers. */
+
+#define RLD_FNIB 0x1111111111111111ull
+
+int rld_index_fast(rld_t *e)
+{
+	uint64_t n_lines, k = 0, cnt[6];
+	rlditr_t itr;
+	int64_t l;
+	int c, j;
+	void *p;
+	if (e->asize > 6) return -1;
+	if (e->fast) return 0;
+	n_lines = e->mcnt[0] / RLD_FSYM + 1;
+	if (posix_memalign(&p, 64, n_lines * 64) != 0) return -1;
+	e->fast = (uint64_t*)p;
+	memset(e->fast, 0, n_lines * 64);
+	e->fsuper = xcalloc(((n_lines >> RLD_FSBITS) + 1) * 6, 8);
+	for (j = 0; j < 6; ++j) cnt[j] = 0;
+	rld_itr_init(e, &itr, 0);
+	while ((l = rld_dec(e, &itr, &c, 0)) > 0) {
+		for (; l > 0; --l, ++k) {
+			uint64_t i = k / RLD_FSYM, *q = e->fast + (i<<3);
+			int x = k - i * RLD_FSYM;
+			if (x == 0) { // start a new line
+				uint64_t *s = e->fsuper + (i >> RLD_FSBITS) * 6;
+				if ((i & ((1ull<<RLD_FSBITS) - 1)) == 0)
+					for (j = 0; j < 6; ++j) s[j] = cnt[j];
+				for (j = 0; j < 6; ++j) ((uint32_t*)q)[j] = cnt[j] - s[j];
+			}
+			q[3 + (x>>4)] |= (uint64_t)c << ((x&0xf)<<2);
+			++cnt[c];
+		}
+	}
+	return 0;
+}
+
+rld_t *rld_restore_fast(const char *fn)
+{
+	rld_t *e;
+	if ((e = rld_restore(fn)) == 0) return 0;
+	rld_index_fast(e);
 	return e;
 }
 
+static inline uint64_t rld_fast_sum(uint64_t x) // sum of nibbles, each no larger than 5
+{
+	x = (x & 0x0f0f0f0f0f0f0f0full) + (x >> 4 & 0x0f0f0f0f0f0f0f0full);
+	return x * 0x0101010101010101ull >> 56;
+}
+
+static inline int rld_rank1a_fast(const rld_t *e, uint64_t k, uint64_t *ok)
+{
+	uint64_t i = k / RLD_FSYM, a0 = 0, a1 = 0, a2 = 0, a3 = 0, a4 = 0, a5 = 0;
+	const uint64_t *p = e->fast + (i<<3), *s = e->fsuper + (i >> RLD_FSBITS) * 6;
+	const uint32_t *q = (const uint32_t*)p;
+	int j, x = k - i * RLD_FSYM;
+	for (j = 0; j <= x>>4; ++j) {
+		uint64_t m = j < x>>4? RLD_FNIB : RLD_FNIB >> ((15 - (x&0xf)) << 2), w = p[3 + j];
+		uint64_t b0 = w & m, b1 = w >> 1 & m, b2 = w >> 2 & m, n0 = b0 ^ m, n1 = b1 ^ m, n2 = b2 ^ m;
+		a0 += n0 & n1 & n2; a1 += b0 & n1 & n2; a2 += n0 & b1 & n2;
+		a3 += b0 & b1 & n2; a4 += n0 & n1 & b2; a5 += b0 & n1 & b2;
+	}
+	ok[0] = s[0] + q[0] + rld_fast_sum(a0);
+	ok[1] = s[1] + q[1] + rld_fast_sum(a1);
+	ok[2] = s[2] + q[2] + rld_fast_sum(a2);
+	ok[3] = s[3] + q[3] + rld_fast_sum(a3);
+	ok[4] = s[4] + q[4] + rld_fast_sum(a4);
+	ok[5] = s[5] + q[5] + rld_fast_sum(a5);
+	return p[3 + (x>>4)] >> ((x&0xf)<<2) & 0xf;
+}
+
+static inline uint64_t rld_rank11_fast(const rld_t *e, uint64_t k, int c)
+{
+	uint64_t i = k / RLD_FSYM, a = 0, y = RLD_FNIB * c;
+	const uint64_t *p = e->fast + (i<<3);
+	int j, x = k - i * RLD_FSYM;
+	for (j = 0; j <= x>>4; ++j) {
+		uint64_t m = j < x>>4? RLD_FNIB : RLD_FNIB >> ((15 - (x&0xf)) << 2), w = p[3 + j] ^ y;
+		a += ~(w | w >> 1 | w >> 2) & m;
+	}
+	return e->fsuper[(i >> RLD_FSBITS) * 6 + c] + ((const uint32_t*)p)[c] + rld_fast_sum(a);
+}
+
 /******************
  * Computing rank *
  ******************/
@@ -391,6 +1287,47 @@ static inline uint64_t rld_locate_blk(const rld_t *e, rlditr_t *itr, uint64_t k,
 	return c + *sum;
 }
 
+void rld_itr_seek(const rld_t *e, rlditr_t *itr, uint64_t k)
+{
+	uint64_t *cnt, sum;
+	int64_t l;
+	int c = 0;
+	cnt = alloca(e->asize1 * 8);
+	rld_locate_blk(e, itr, k, cnt, &sum);
+	while (sum + (l = rld_dec0(e, itr, &c)) <= k) sum += l;
+	itr->l = sum + l - k, itr->c = c; // the rest of the run at k is pending
+}
+
+static inline uint64_t rld_locate_blk1(const rld_t *e, rlditr_t *itr, uint64_t k, int a, uint64_t *cnt, uint64_t *sum)
+{ // similar to rld_locate_blk() but only counts symbol $a
+	int j;
+	uint64_t c = 0, *q, *z = e->frame + (k>>e->ibits) * e->asize1;
+	itr->i = e->z + (*z>>RLD_LBITS);
+	q = itr->p = *itr->i + (*z&RLD_LMASK);
+	for (j = 1, *sum = 0; j < e->asize1; ++j) *sum += z[j];
+	*cnt = z[a + 1];
+	while (1) { // seek to the small block
+		q += e->ssize;
+		if (q - *itr->i == RLD_LSIZE) q = *++itr->i;
+#ifdef _USE_RLE6
+		if (*sum + (c = *(uint16_t*)q) > k) break;
+		*cnt += ((uint16_t*)q)[a + 1];
+#else
+		c = rld_size_bit(*q)? (uint32_t)(*q)&0x7fffffff : *(uint16_t*)q;
+		if (*sum + c > k) break;
+		*cnt += rld_size_bit(*q)? ((uint32_t*)q)[a + 1] : ((uint16_t*)q)[a + 1];
+#endif
+		*sum += c;
+		itr->p = q;
+	}
+	itr->shead = itr->p;
+	itr->stail = rld_get_stail(e, itr);
+	itr->p += e->offset0[rld_size_bit(*itr->shead)];
+	itr->q = (uint8_t*)itr->p;
+	itr->r = 64;
+	return c + *sum;
+}
+
 #if defined(_DNA_ONLY) && !defined(_USE_RLE6)
 static inline int64_t rld_dec0_dna(const rld_t *e, rlditr_t *itr, int *c)
 {
@@ -413,45 +1350,85 @@ static inline int64_t rld_dec0_dna(const rld_t *e, rlditr_t *itr, int *c)
 		return 1;
 	}
 }
+#define RLD_DEC0 rld_dec0_dna
+#else
+#define RLD_DEC0 rld_dec0
 #endif
 
-void rld_rank21(const rld_t *e, uint64_t k, uint64_t l, int c, uint64_t *ok, uint64_t *ol) // FIXME: can be faster
-{
-	*ok = rld_rank11(e, k, c);
-	*ol = rld_rank11(e, l, c);
+static inline int64_t rld_dec_rank(const rld_t *e, rlditr_t *itr, uint64_t k, uint64_t *z, uint64_t *cnt, int *a)
+{ // decode runs until reaching the run bracketing position k-1; *z is the position before that run
+	int64_t l;
+	while (1) {
+		l = RLD_DEC0(e, itr, a);
+		if (*z + l >= k) break;
+		*z += l; cnt[*a] += l;
+	}
+	return l;
+}
+
+static inline int64_t rld_dec_rank1(const rld_t *e, rlditr_t *itr, uint64_t k, uint64_t *z, int b, uint64_t *cnt, int *a)
+{ // similar to rld_dec_rank() but only counts symbol $b
+	int64_t l;
+	while (1) {
+		l = RLD_DEC0(e, itr, a);
+		if (*z + l >= k) break;
+		*z += l; *cnt += *a == b? l : 0;
+	}
+	return l;
 }
 
 int rld_rank1a(const rld_t *e, uint64_t k, uint64_t *ok)
 {
-	uint64_t z, l;
+	uint64_t z;
 	int a = -1;
 	rlditr_t itr;
 	if (k == (uint64_t)-1) {
 		for (a = 0; a < e->asize; ++a) ok[a] = 0;
 		return -1;
 	}
+	if (e->fast) return rld_rank1a_fast(e, k, ok);
 	rld_locate_blk(e, &itr, k, ok, &z);
 	++k; // because k is the coordinate but not length
-	while (1) {
-#if defined(_DNA_ONLY) && !defined(_USE_RLE6)
-		l = rld_dec0_dna(e, &itr, &a);
-#else
-		l = rld_dec0(e, &itr, &a);
-#endif
-		if (z + l >= k) break;
-		z += l; ok[a] += l;
-	}
+	rld_dec_rank(e, &itr, k, &z, ok, &a);
 	ok[a] += k - z;
 	return a;
 }
 
 uint64_t rld_rank11(const rld_t *e, uint64_t k, int c)
 {
-	uint64_t *ok;
+	uint64_t z, x;
+	rlditr_t itr;
+	int a = -1;
 	if (k == (uint64_t)-1) return 0;
-	ok = alloca(e->asize1 * 8);
-	rld_rank1a(e, k, ok);
-	return ok[c];
+	if (e->fast) return rld_rank11_fast(e, k, c);
+	rld_locate_blk1(e, &itr, k, c, &x, &z);
+	++k;
+	rld_dec_rank1(e, &itr, k, &z, c, &x, &a);
+	return a == c? x + (k - z) : x;
+}
+
+void rld_rank21(const rld_t *e, uint64_t k, uint64_t l, int c, uint64_t *ok, uint64_t *ol)
+{
+	uint64_t z, y, x, len;
+	rlditr_t itr;
+	int a = -1;
+	if (k == (uint64_t)-1 || l < k || e->fast) {
+		*ok = rld_rank11(e, k, c);
+		*ol = rld_rank11(e, l, c);
+		return;
+	}
+	y = rld_locate_blk1(e, &itr, k, c, &x, &z); // locate the block bracketing k
+	++k; // because k is the coordinate but not length
+	len = rld_dec_rank1(e, &itr, k, &z, c, &x, &a);
+	*ok = a == c? x + (k - z) : x;
+	if (y > l) { // l is in the same block; continue from the run bracketing k
+		++l;
+		if (z + len < l) {
+			z += len; x += a == c? len : 0;
+			rld_dec_rank1(e, &itr, l, &z, c, &x, &a);
+		}
+		*ol = a == c? x + (l - z) : x;
+	} else *ol = rld_rank11(e, l, c);
 }
 
 void rld_rank2a(const rld_t *e, uint64_t k, uint64_t l, uint64_t *ok, uint64_t *ol)
@@ -464,13 +1441,14 @@ void rld_rank2a(const rld_t *e, uint64_t k, uint64_t l, uint64_t *ok, uint64_t *
 		rld_rank1a(e, l, ol);
 		return;
 	}
+	if (e->fast) {
+		rld_rank1a_fast(e, k, ok);
+		rld_rank1a_fast(e, l, ol);
+		return;
+	}
 	y = rld_locate_blk(e, &itr, k, ok, &z); // locate the block bracketing k
 	++k; // because k is the coordinate but not length
-	while (1) { // compute ok[]
-		len = rld_dec0(e, &itr, &a);
-		if (z + len >= k) break;
-		z += len; ok[a] += len;
-	}
+	len = rld_dec_rank(e, &itr, k, &z, ok, &a); // compute ok[]
 	if (y > l) { // we do not need to decode other blocks
 		int b;
 		++l; // for a similar reason to ++l
@@ -478,11 +1456,7 @@ void rld_rank2a(const rld_t *e, uint64_t k, uint64_t l, uint64_t *ok, uint64_t *
 		ok[a] += k - z; // finalize ok[a]
 		if (z + len < l) { // we need to decode the next run
 			z += len; ol[a] += len;
-			while (1) {
-				len = rld_dec0(e, &itr, &a);
-				if (z + len >= l) break;
-				z += len; ol[a] += len;
-			}
+			rld_dec_rank(e, &itr, l, &z, ol, &a);
 		}
 		ol[a] += l - z;
 	} else { // we have to decode other blocks
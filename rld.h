@@ -10,6 +10,16 @@
 #define RLD_LSIZE (1<<RLD_LBITS)
 #define RLD_LMASK (RLD_LSIZE - 1)
 
+#define RLD_FSYM   80 // symbols per 64-byte line in the uncompressed rank index
+#define RLD_FSBITS 24 // log2 of lines per superblock in the uncompressed rank index
+
+// flags for rld_restore_mmap_opt(); bits 0-7 apply to the blocks and bits 8-15 to the frames (RLD\3 only)
+#define RLD_MAP_POPULATE 0x1 // fault in all pages at load time
+#define RLD_MAP_HUGEPAGE 0x2 // madvise(MADV_HUGEPAGE)
+#define RLD_MAP_WILLNEED 0x4 // madvise(MADV_WILLNEED)
+#define RLD_MAP_VERIFY   0x8 // verify the checksum
+#define RLD_MAP_FRAME(f) ((f)<<8)
+
 typedef struct {
 	int r, c; // $r: bits remained in the last 64-bit integer; $c: pending symbol
 	int64_t l; // $l: pending length
@@ -36,6 +46,11 @@ typedef struct __rld_t {
 	//
 	int fd;
 	uint64_t *mem; // only used for memory mapped file
+	uint64_t mem_size;
+	// uncompressed rank index; built by rld_index_fast()
+	uint64_t *fast, *fsuper; // 64-byte lines and 64-bit counts for each superblock
+	struct __fmkmi_t *kmi; // k-mer interval table attached by fermi; not freed by rld_destroy()
+	struct __fmsa_t *sa; // sampled suffix array attached by fermi; not freed by rld_destroy()
 } rld_t;
 
 #ifdef __cplusplus
@@ -44,13 +59,29 @@ extern "C" {
 
 	rld_t *rld_init(int asize, int bbits);
 	void rld_destroy(rld_t *e);
-	int rld_dump(const rld_t *e, const char *fn);
+	int rld_dump(const rld_t *e, const char *fn); // in the RLD\2 format
+	int rld_dump_v3(const rld_t *e, const char *fn); // in the RLD\3 format, with checksums
 	rld_t *rld_restore(const char *fn);
 	rld_t *rld_restore_mmap(const char *fn);
+	rld_t *rld_restore_mmap_opt(const char *fn, int flag);
+	rld_t *rld_restore_mt(const char *fn, int n_threads); // with pread() in parallel
+	int rld_dump_mt(const rld_t *e, const char *fn, int n_threads); // with pwrite() in parallel
+	int rld_dump_mt_v3(const rld_t *e, const char *fn, int n_threads);
+
+	int rld_shm_load(const char *fn); // 0 on success, -2 if already loaded, or -1 on other errors
+	int rld_shm_unload(const char *fn);
+	rld_t *rld_attach_shm(const char *fn, int flag); // returns 0 if $fn is not loaded; $flag as in rld_restore_mmap_opt()
+	rld_t *rld_restore_fast(const char *fn);
+	int rld_index_fast(rld_t *e);
 
 	void rld_itr_init(const rld_t *e, rlditr_t *itr, uint64_t k);
+	void rld_itr_seek(const rld_t *e, rlditr_t *itr, uint64_t k); // decode from symbol k; requires the rank index
 	int rld_enc(rld_t *e, rlditr_t *itr, int64_t l, uint8_t c);
 	uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr);
+	uint64_t rld_enc_finish_mt(rld_t *e, rlditr_t *itr, int n_threads); // with the frames computed in parallel; no frames if n_threads==0
+	rld_t *rld_join(int n, rld_t **parts, int n_threads); // concatenate parts finished without frames; parts are freed
+	int64_t rld_copy_blks(rld_t *e, rlditr_t *itr, const rld_t *e0, rlditr_t *itr0, int64_t k, int is_free);
+	void rld_rank_index_mt(rld_t *e, int n_threads);
 
 	uint64_t rld_rank11(const rld_t *e, uint64_t k, int c);
 	int rld_rank1a(const rld_t *e, uint64_t k, uint64_t *ok);
@@ -97,7 +128,7 @@ static inline int64_t rld_dec0(const rld_t *e, rlditr_t *itr, int *c)
 static inline int64_t rld_dec(const rld_t *e, rlditr_t *itr, int *_c, int is_free)
 {
 	int64_t l = rld_dec0(e, itr, _c);
-	if (l == 0 || *_c > e->asize) {
+	while (l == 0 || *_c > e->asize) { // a loop as rld_join() may leave empty blocks
 		uint64_t last = rld_last_blk(e);
 		if (itr->p - *itr->i > RLD_LSIZE - e->ssize) {
 			if (is_free) {
@@ -110,12 +141,49 @@ static inline int64_t rld_dec(const rld_t *e, rlditr_t *itr, int *_c, int is_fre
 		itr->q = (uint8_t*)itr->p;
 		itr->stail = rld_get_stail(e, itr);
 		itr->r = 64;
-		return rld_dec0(e, itr, _c);
-	} else return l;
+		l = rld_dec0(e, itr, _c);
+	}
+	return l;
+}
+
+#ifdef __GNUC__
+#define rld_prefetch(p) __builtin_prefetch(p)
+#else
+#define rld_prefetch(p)
+#endif
+
+// prefetch the frame entry for rank at k; the first stage of a batched rank
+static inline void rld_prefetch_frame(const rld_t *e, uint64_t k)
+{
+	if (k == (uint64_t)-1) return;
+	if (e->fast) rld_prefetch(e->fast + (k / RLD_FSYM << 3));
+	else rld_prefetch(e->frame + (k>>e->ibits) * e->asize1);
+}
+
+// prefetch the small block likely to bracket k, interpolated between two frame entries; the second stage
+static inline void rld_prefetch_blk(const rld_t *e, uint64_t k)
+{
+	const uint64_t *z;
+	uint64_t b0, b1, x;
+	if (k == (uint64_t)-1 || e->fast) return;
+	z = e->frame + (k>>e->ibits) * e->asize1;
+	b0 = z[0] >> e->sbits, b1 = (k>>e->ibits) + 1 < e->n_frames? z[e->asize1] >> e->sbits : b0;
+	x = (b0 + ((b1 - b0) * (k & ((1ull<<e->ibits) - 1)) >> e->ibits)) << e->sbits;
+	rld_prefetch(rld_seek_blk(e, x));
+}
+
+#define RLD_COPY_MIN 1024 // try to copy whole blocks if at least this many symbols are left
+
+static inline int rld_blk_end(const rld_t *e, const rlditr_t *itr) // no runs left in the current block
+{
+	rlditr_t t = *itr;
+	int c;
+	int64_t l = rld_dec0(e, &t, &c);
+	return l == 0 || c > e->asize;
 }
 
 // take k symbols from e0 and write it to e
-static inline void rld_dec_enc(rld_t *e, rlditr_t *itr, const rld_t *e0, rlditr_t *itr0, int64_t k)
+static inline void rld_dec_enc(rld_t *e, rlditr_t *itr, const rld_t *e0, rlditr_t *itr0, int64_t k, int is_free)
 {
 	if (itr0->l >= k) { // there are more pending symbols
 		rld_enc(e, itr, k, itr0->c);
@@ -126,7 +194,13 @@ static inline void rld_dec_enc(rld_t *e, rlditr_t *itr, const rld_t *e0, rlditr_
 		rld_enc(e, itr, itr0->l, itr0->c); // write all pending symbols
 		k -= itr0->l;
 		for (; k > 0; k -= l) { // we always go into this loop because l0<k
-			l = rld_dec(e0, itr0, &c, 1);
+#ifndef _USE_RLE6
+			if (k >= RLD_COPY_MIN && rld_blk_end(e0, itr0) && (k = rld_copy_blks(e, itr, e0, itr0, k, is_free)) == 0) {
+				l = 0;
+				break;
+			}
+#endif
+			l = rld_dec(e0, itr0, &c, is_free);
 			rld_enc(e, itr, k < l? k : l, c);
 		}
 		itr0->l = -k; itr0->c = c;
@@ -2,8 +2,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "bprope6.h"
 #include "bcr.h"
+#include "rld.h"
 #include "kseq.h"
 KSEQ_INIT(gzFile, gzread)
 
@@ -16,10 +18,45 @@ enum algo_e { BPR, RBR, BCR };
 #define FLAG_ODD 0x4
 #define FLAG_BIN 0x8
 #define FLAG_TREE 0x10
-#define FLAG_THR 0x20
 #define FLAG_CUTN 0x40
+#define FLAG_COMP 0x80
+#define FLAG_FMD 0x100
 
-static void insert1(int flag, int l, uint8_t *s, bprope6_t *bpr, bcr_t *bcr)
+#define BPR_BATCH_SIZE 0x4000000 // with bpr -t, strings are inserted in batches of this many symbols
+
+typedef struct { // strings to be inserted in a batch
+	int64_t n, m, l, ml;
+	int *len;
+	uint8_t *s; // concatenated strings
+} bprbuf_t;
+
+static void bprbuf_add(bprbuf_t *b, int l, const uint8_t *s)
+{
+	if (b->n == b->m) {
+		b->m = b->m? b->m<<1 : 256;
+		b->len = realloc(b->len, b->m * sizeof(int));
+	}
+	if (b->l + l > b->ml) {
+		while (b->l + l > b->ml) b->ml = b->ml? b->ml<<1 : 0x10000;
+		b->s = realloc(b->s, b->ml);
+	}
+	memcpy(b->s + b->l, s, l);
+	b->len[b->n++] = l, b->l += l;
+}
+
+static void bprbuf_flush(bprbuf_t *b, bprope6_t *bpr, int n_threads)
+{
+	const uint8_t **seq;
+	int64_t i, k;
+	if (b->n == 0) return;
+	seq = malloc(b->n * sizeof(void*));
+	for (i = k = 0; i < b->n; k += b->len[i++]) seq[i] = b->s + k;
+	bpr_insert_batch(bpr, b->n, b->len, seq, n_threads);
+	free(seq);
+	b->n = b->l = 0;
+}
+
+static void insert1(int flag, int l, uint8_t *s, bprope6_t *bpr, bprbuf_t *buf, bcr_t *bcr)
 {
 	int i;
 	if ((flag & FLAG_ODD) && (l&1) == 0) { // then check reverse complement
@@ -28,7 +65,8 @@ static void insert1(int flag, int l, uint8_t *s, bprope6_t *bpr, bcr_t *bcr)
 		if (i == l>>1) --l; // if so, trim 1bp from the end
 	}
 	if (flag & FLAG_FOR) {
-		if (bpr) bpr_insert_string(bpr, l, s);
+		if (buf) bprbuf_add(buf, l, s);
+		else if (bpr) bpr_insert_string(bpr, l, s);
 		if (bcr) bcr_append(bcr, l, s);
 	}
 	if (flag & FLAG_REV) {
@@ -39,36 +77,93 @@ static void insert1(int flag, int l, uint8_t *s, bprope6_t *bpr, bcr_t *bcr)
 			s[i] = tmp;
 		}
 		if (l&1) s[i] = (s[i] >= 1 && s[i] <= 4)? 5 - s[i] : s[i];
-		if (bpr) bpr_insert_string(bpr, l, s);
+		if (buf) bprbuf_add(buf, l, s);
+		else if (bpr) bpr_insert_string(bpr, l, s);
 		if (bcr) bcr_append(bcr, l, s);
 	}
 }
 
+/* With -d, the runs are encoded into an FM-index without going through the
+ * plain run-length output. The run-length chunks (BCR blocks or BPR leaves)
+ * are collected, split into parts of about the same size, encoded in parallel
+ * and joined. */
+
+typedef struct {
+	int n; // number of chunks
+	const uint8_t **s;
+	const int *l;
+	rld_t *e;
+} enc_worker_t;
+
+static void *enc_worker(void *data)
+{
+	enc_worker_t *w = (enc_worker_t*)data;
+	rlditr_t itr;
+	int i, j;
+	w->e = rld_init(6, 3);
+	rld_itr_init(w->e, &itr, 0);
+	for (i = 0; i < w->n; ++i)
+		for (j = 0; j < w->l[i]; ++j)
+			if (w->s[i][j]>>3) rld_enc(w->e, &itr, w->s[i][j]>>3, w->s[i][j]&7);
+	rld_enc_finish_mt(w->e, &itr, 0); // the frames are computed by rld_join()
+	return 0;
+}
+
+static rld_t *enc_runs(int n, const uint8_t **s, const int *l, int n_threads)
+{
+	pthread_t *tid;
+	pthread_attr_t attr;
+	enc_worker_t *w;
+	rld_t **parts;
+	int64_t tot = 0, sum = 0;
+	int i, j, k;
+
+	for (i = 0; i < n; ++i) tot += l[i];
+	if (n_threads > n) n_threads = n > 0? n : 1;
+	tid = (pthread_t*)alloca(n_threads * sizeof(pthread_t));
+	w = (enc_worker_t*)alloca(n_threads * sizeof(enc_worker_t));
+	parts = (rld_t**)alloca(n_threads * sizeof(void*));
+	for (j = k = 0; j < n_threads; ++j) { // part j takes chunks until it reaches (j+1)/n_threads of the total
+		w[j].s = s + k, w[j].l = l + k;
+		for (i = k; i < n && (j == n_threads - 1 || sum < tot / n_threads * (j + 1)); ++i) sum += l[i];
+		w[j].n = i - k, k = i;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (j = 0; j < n_threads; ++j) pthread_create(&tid[j], &attr, enc_worker, &w[j]);
+	for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0), parts[j] = w[j].e;
+	pthread_attr_destroy(&attr);
+	return rld_join(n_threads, parts, n_threads);
+}
+
 int main_ropebwt(int argc, char *argv[])
 {
 	bprope6_t *bpr = 0;
+	bprbuf_t *buf = 0;
 	bcr_t *bcr = 0;
 	gzFile fp;
-	FILE *out = stdout;
-	char *tmpfn = 0;
+	FILE *out;
+	char *tmpfn = 0, *fn_out = 0;
 	kseq_t *ks;
 	enum algo_e algo = BPR;
-	int c, max_runs = 512, max_nodes = 64;
+	int c, max_runs = 512, max_nodes = 64, n_threads = 1;
 	int flag = FLAG_FOR | FLAG_REV | FLAG_ODD;
 
-	while ((c = getopt(argc, argv, "TFRObNo:r:n:ta:f:v:")) >= 0)
+	while ((c = getopt(argc, argv, "TFRObdNzo:r:n:t:a:f:v:")) >= 0)
 		if (c == 'a') {
 			if (strcmp(optarg, "bpr") == 0) algo = BPR;
 			else if (strcmp(optarg, "bcr") == 0) algo = BCR;
 			else fprintf(stderr, "[W::%s] available algorithms: bpr or bcr; default to bpr\n", __func__);
-		} else if (c == 'o') out = fopen(optarg, "wb");
+		} else if (c == 'o') fn_out = optarg;
 		else if (c == 'F') flag &= ~FLAG_FOR;
 		else if (c == 'R') flag &= ~FLAG_REV;
 		else if (c == 'O') flag &= ~FLAG_ODD;
 		else if (c == 'T') flag |= FLAG_TREE;
 		else if (c == 'b') flag |= FLAG_BIN;
+		else if (c == 'd') flag |= FLAG_FMD;
 		else if (c == 'N') flag |= FLAG_CUTN;
-		else if (c == 't') flag |= FLAG_THR;
+		else if (c == 'z') flag |= FLAG_COMP;
+		else if (c == 't') n_threads = atoi(optarg);
 		else if (c == 'r') max_runs = atoi(optarg);
 		else if (c == 'n') max_nodes= atoi(optarg);
 		else if (c == 'f') tmpfn = optarg;
@@ -82,9 +177,11 @@ int main_ropebwt(int argc, char *argv[])
 		fprintf(stderr, "         -n INT     max number children per internal node (bpr only) [%d]\n", max_nodes);
 		fprintf(stderr, "         -o FILE    output file [stdout]\n");
 		fprintf(stderr, "         -f FILE    temporary sequence file name (bcr only) [null]\n");
+		fprintf(stderr, "         -z         compress the temporary file (bcr only)\n");
 		fprintf(stderr, "         -v INT     verbose level (bcr only) [%d]\n", bcr_verbose);
 		fprintf(stderr, "         -b         binary output (5+3 runs starting after 4 bytes)\n");
-		fprintf(stderr, "         -t         enable threading (bcr only)\n");
+		fprintf(stderr, "         -d         output the FM-index as fermi build does\n");
+		fprintf(stderr, "         -t INT     number of threads [%d]\n", n_threads);
 		fprintf(stderr, "         -F         skip forward strand\n");
 		fprintf(stderr, "         -R         skip reverse strand\n");
 		fprintf(stderr, "         -N         cut at ambiguous bases\n");
@@ -94,9 +191,12 @@ int main_ropebwt(int argc, char *argv[])
 	}
 
 	if (algo == BCR) {
-		bcr = bcr_init(flag&FLAG_THR, tmpfn);
+		bcr = bcr_init(n_threads, tmpfn, flag&FLAG_COMP);
 		if (!(flag&FLAG_CUTN)) fprintf(stderr, "Warning: With bcr, an ambiguous base will be converted to a random base\n");
-	} else if (algo == BPR) bpr = bpr_init(max_nodes, max_runs);
+	} else if (algo == BPR) {
+		bpr = bpr_init(max_nodes, max_runs);
+		if (n_threads > 1) buf = calloc(1, sizeof(bprbuf_t));
+	}
 	fp = strcmp(argv[optind], "-")? gzopen(argv[optind], "rb") : gzdopen(fileno(stdin), "rb");
 	ks = kseq_init(fp);
 	while (kseq_read(ks) >= 0) {
@@ -109,20 +209,25 @@ int main_ropebwt(int argc, char *argv[])
 			uint8_t *s;
 			for (j = l = 0, s = t; j < ks->seq.l; ++j) {
 				if (t[j] == 5 && (flag&FLAG_CUTN)) {
-					if (l) insert1(flag, l, s, bpr, bcr);
+					if (l) insert1(flag, l, s, bpr, buf, bcr);
 					s = t + l + 1; l = 0;
 				} else ++l;
 			}
-			if (l) insert1(flag, l, s, bpr, bcr);
+			if (l) insert1(flag, l, s, bpr, buf, bcr);
 		} else {
 			if (algo == BCR) // BCR cannot handle ambiguous bases
 				for (j = 0; j < ks->seq.l; ++j) // convert an ambiguous base to a random base
 					if (t[j] == 5) t[j] = (lrand48()&3) + 1;
-			insert1(flag, ks->seq.l, t, bpr, bcr);
+			insert1(flag, ks->seq.l, t, bpr, buf, bcr);
 		}
+		if (buf && buf->l >= BPR_BATCH_SIZE) bprbuf_flush(buf, bpr, n_threads);
 	}
 	kseq_destroy(ks);
 	gzclose(fp);
+	if (buf) {
+		bprbuf_flush(buf, bpr, n_threads);
+		free(buf->len); free(buf->s); free(buf);
+	}
 
 #define print_bwt(itr_t, itr_set, itr_next_f, is_bin, fp) do { \
 		itr_t *itr; \
@@ -143,16 +248,44 @@ int main_ropebwt(int argc, char *argv[])
 		free(itr); \
 	} while (0)
 
+#define collect_runs(itr_t, itr_set, itr_next_f, n, s, l) do { \
+		itr_t *itr; \
+		const uint8_t *p; \
+		int m = 0, len; \
+		itr = (itr_set); \
+		while ((p = itr_next_f(itr, &len)) != 0) { \
+			if (n == m) { \
+				m = m? m<<1 : 256; \
+				s = realloc(s, m * sizeof(void*)); \
+				l = realloc(l, m * sizeof(int)); \
+			} \
+			s[n] = p, l[n++] = len; \
+		} \
+		free(itr); \
+	} while (0)
+
+	if (bcr) bcr_build(bcr);
+	if (flag & FLAG_FMD) {
+		const uint8_t **s = 0;
+		int *l = 0, n = 0;
+		rld_t *e;
+		if (bpr) collect_runs(bpriter_t, bpr_iter_init(bpr), bpr_iter_next, n, s, l);
+		if (bcr) collect_runs(bcritr_t, bcr_itr_init(bcr), bcr_itr_next, n, s, l);
+		e = enc_runs(n, s, l, n_threads);
+		free(s); free(l);
+		if (rld_dump_mt(e, fn_out? fn_out : "-", n_threads) < 0)
+			fprintf(stderr, "[E::%s] failed to write the FM-index to `%s'\n", __func__, fn_out? fn_out : "-");
+		rld_destroy(e);
+	} else {
+		out = fn_out? fopen(fn_out, "wb") : stdout;
+		if (bpr) print_bwt(bpriter_t, bpr_iter_init(bpr), bpr_iter_next, flag&FLAG_BIN, out);
+		if (bcr) print_bwt(bcritr_t, bcr_itr_init(bcr), bcr_itr_next, flag&FLAG_BIN, out);
+		fclose(out);
+	}
 	if (bpr) {
-		print_bwt(bpriter_t, bpr_iter_init(bpr), bpr_iter_next, flag&FLAG_BIN, out);
 		if (flag&FLAG_TREE) bpr_print(bpr);
 		bpr_destroy(bpr);
 	}
-	if (bcr) {
-		bcr_build(bcr);
-		print_bwt(bcritr_t, bcr_itr_init(bcr), bcr_itr_next, flag&FLAG_BIN, out);
-		bcr_destroy(bcr);
-	}
-	fclose(out);
+	if (bcr) bcr_destroy(bcr);
 	return 0;
 }
@@ -13,7 +13,7 @@ typedef struct {
 int fm6_smem1_core(const rld_t *e, int len, const uint8_t *q, int x, fmintv_v *mem, int self_match, fmintv_v *prev, fmintv_v *curr)
 {
 	int i, j, c, ret;
-	fmintv_t ik, ok[6];
+	fmintv_t ik, ok[6], okb[FM_BATCH][6];
 	fmintv_v *swap;
 
 	fm6_set_intv(e, q[x], ik);
@@ -51,23 +51,24 @@ int fm6_smem1_core(const rld_t *e, int len, const uint8_t *q, int x, fmintv_v *m
 	for (i = x - 1; i >= -1; --i) { // backward search for MEMs
 		c = i < 0? 0 : q[i];
 		for (j = 0, curr->n = 0; j < prev->n; ++j) {
-			fmintv_t *p = &prev->a[j];
+			fmintv_t *p = &prev->a[j], *o = okb[j%FM_BATCH];
 			int cont, fl_match; // whether this leads to a full-length read match
-			fm6_extend(e, p, ok, 1);
-			fl_match = (ok[0].x[2] && p->x[1] < e->mcnt[1]);
-			cont = self_match? (ok[c].x[2] > 1) : (ok[c].x[2] != 0);
+			if (j % FM_BATCH == 0) // extend the next batch of intervals in prev
+				fm6_extend_batch(e, prev->n - j < FM_BATCH? prev->n - j : FM_BATCH, p, okb, 1);
+			fl_match = (o[0].x[2] && p->x[1] < e->mcnt[1]);
+			cont = self_match? (o[c].x[2] > 1) : (o[c].x[2] != 0);
 			if (!cont || fl_match || i == -1) { // keep the hit if: full-length match, reaching the beginning or not extended further
 				if (curr->n == 0 || fl_match) { // curr->n to make sure there is no longer matches
 //					printf("%d, %lld, [%lld,%lld,%lld]\n", i+1, p->info, p->x[0], p->x[1], p->x[2]);
 					if (fl_match || mem->n == 0 || i + 1 < (mem->a[mem->n-1].info>>32&FM_MASK30)) { // skip contained matches
-						ik = *p; ik.info |= (uint64_t)(ok[0].x[2] != 0) << 63 | (uint64_t)(i + 1)<<32; // bit 64 keeps whether the left-end is closed
+						ik = *p; ik.info |= (uint64_t)(o[0].x[2] != 0) << 63 | (uint64_t)(i + 1)<<32; // bit 64 keeps whether the left-end is closed
 						kv_push(fmintv_t, *mem, ik);
 					}
 				} // otherwise the match is contained in another longer match
 			}
-			if (cont && (p->x[1] < e->mcnt[1] || curr->n == 0 || ok[c].x[2] != curr->a[curr->n-1].x[2])) {
-				ok[c].info = p->info;
-				kv_push(fmintv_t, *curr, ok[c]);
+			if (cont && (p->x[1] < e->mcnt[1] || curr->n == 0 || o[c].x[2] != curr->a[curr->n-1].x[2])) {
+				o[c].info = p->info;
+				kv_push(fmintv_t, *curr, o[c]);
 			}
 		}
 		if (curr->n == 0) break;
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "priv.h"
+#include "kvec.h"
+
+/* The sampled suffix array keeps the (read, offset) of every row whose offset
+ * is a multiple of the sampling rate, plus the row of each sentinel. As offset
+ * 0 is always sampled, fm_locate() reaches a sample in less than $rate LF
+ * steps. Sampled rows are marked in a bit vector with a popcount every 512
+ * bits. A rank->read map is obtained from the same traversal and saved as
+ * well, without the flags of fm6_seqsort() in the lowest 2 bits. Each strand
+ * is walked on its own, whereas fm6_seqsort() derives the rank of the reverse
+ * strand from the interval of the forward one; the two maps thus differ on
+ * reads with identical copies and on palindromic reads.
+ *
+ * The .sa file consists of a 32-byte header (magic, rate, n_syms, n_seqs and
+ * the number of samples), the bit vector, the popcounts, the samples and the
+ * rank->read map, all in 64-bit words such that it can be memory mapped. */
+
+#define SSA_HDR 32
+
+#define ssa_n_bits(n) (((n) + 63) >> 6)
+#define ssa_n_cnt(n) (((n) + 511) >> 9)
+
+static inline uint64_t ssa_rank(const fmsa_t *sa, uint64_t k) // number of samples before row k
+{
+	const uint64_t *p = sa->bits + (k >> 9 << 3), *q = sa->bits + (k >> 6);
+	uint64_t r = sa->cnt[k >> 9];
+	for (; p < q; ++p) r += __builtin_popcountll(*p);
+	return r + __builtin_popcountll(*q & ((1ULL << (k & 63)) - 1));
+}
+
+static void ssa_set_ptr(fmsa_t *sa, uint64_t *x)
+{
+	sa->bits = x;
+	sa->cnt = sa->bits + ssa_n_bits(sa->n_syms);
+	sa->ssa = sa->cnt + ssa_n_cnt(sa->n_syms);
+	sa->rank = sa->ssa + sa->n_ssa;
+}
+
+void fm_sa_destroy(fmsa_t *sa)
+{
+	if (sa == 0) return;
+	if (sa->mem) {
+		munmap(sa->mem, sa->size);
+		close(sa->fd);
+	} else free(sa->bits);
+	free(sa);
+}
+
+typedef struct {
+	const rld_t *e;
+	int tid, n_threads, rate;
+	uint64_t *bits, *rank;
+	ku128_v pairs; // (row, sample)
+	int64_t max_len;
+} worker_t;
+
+static void *worker(void *data)
+{
+	worker_t *w = (worker_t*)data;
+	const rld_t *e = w->e;
+	fm64_v rows;
+	uint64_t i, k, ok[6];
+	kv_init(rows);
+	for (i = w->tid; i < e->mcnt[1]; i += w->n_threads) {
+		int64_t j, len;
+		int c;
+		rows.n = 0;
+		for (k = i;;) { // LF walk from the sentinel of read i to its first base
+			kv_push(uint64_t, rows, k);
+			c = rld_rank1a(e, k, ok);
+			k = e->cnt[c] + ok[c] - 1;
+			if (c == 0) break;
+		}
+		len = rows.n - 1; // rows.a[j] is at offset len-j
+		if (len > w->max_len) w->max_len = len;
+		w->rank[k] = i<<2;
+		for (j = 0; j <= len; ++j) {
+			ku128_t *q;
+			if (j && (len - j) % w->rate) continue;
+			__sync_fetch_and_or(&w->bits[rows.a[j]>>6], 1ULL << (rows.a[j]&63));
+			kv_pushp(ku128_t, w->pairs, &q);
+			q->x = rows.a[j], q->y = i << FM_SA_OBITS | (len - j);
+		}
+	}
+	free(rows.a);
+	return 0;
+}
+
+fmsa_t *fm_sa_build(const rld_t *e, int rate, int n_threads)
+{
+	fmsa_t *sa;
+	pthread_t *tid;
+	pthread_attr_t attr;
+	worker_t *w;
+	uint64_t i, *bits, *rank, n_bits, n_cnt, n_ssa = 0;
+	int64_t max_len = 0;
+	int j;
+
+	if (rate < 1) return 0;
+	if (n_threads < 1) n_threads = 1;
+	n_bits = ssa_n_bits(e->mcnt[0]), n_cnt = ssa_n_cnt(e->mcnt[0]);
+	bits = calloc(n_bits, 8);
+	rank = calloc(e->mcnt[1], 8);
+	tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	w = (worker_t*)calloc(n_threads, sizeof(worker_t));
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (j = 0; j < n_threads; ++j) {
+		w[j].e = e, w[j].rate = rate, w[j].bits = bits, w[j].rank = rank;
+		w[j].tid = j, w[j].n_threads = n_threads;
+		pthread_create(&tid[j], &attr, worker, w + j);
+	}
+	for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0);
+	for (j = 0; j < n_threads; ++j) {
+		n_ssa += w[j].pairs.n;
+		if (w[j].max_len > max_len) max_len = w[j].max_len;
+	}
+	if (max_len >= 1LL<<FM_SA_OBITS) {
+		if (fm_verbose >= 1) fprintf(stderr, "[E::%s] sequences longer than %lld are not supported\n", __func__, (long long)(1LL<<FM_SA_OBITS) - 1);
+		for (j = 0; j < n_threads; ++j) free(w[j].pairs.a);
+		free(w); free(tid); free(bits); free(rank);
+		return 0;
+	}
+	// put everything in one block such that it can be dumped and mapped in the same way
+	sa = calloc(1, sizeof(fmsa_t));
+	sa->rate = rate, sa->fd = -1;
+	sa->n_syms = e->mcnt[0], sa->n_seqs = e->mcnt[1], sa->n_ssa = n_ssa;
+	ssa_set_ptr(sa, malloc((n_bits + n_cnt + n_ssa + sa->n_seqs) * 8));
+	memcpy(sa->bits, bits, n_bits * 8);
+	memcpy(sa->rank, rank, sa->n_seqs * 8);
+	free(bits); free(rank);
+	for (i = 0, n_ssa = 0; i < n_bits; ++i) {
+		if ((i & 7) == 0) sa->cnt[i>>3] = n_ssa;
+		n_ssa += __builtin_popcountll(sa->bits[i]);
+	}
+	for (j = 0; j < n_threads; ++j) {
+		for (i = 0; i < w[j].pairs.n; ++i)
+			sa->ssa[ssa_rank(sa, w[j].pairs.a[i].x)] = w[j].pairs.a[i].y;
+		free(w[j].pairs.a);
+	}
+	free(w); free(tid);
+	return sa;
+}
+
+int fm_sa_dump(const fmsa_t *sa, const char *fn)
+{
+	FILE *fp;
+	int32_t rate = sa->rate;
+	uint64_t n = ssa_n_bits(sa->n_syms) + ssa_n_cnt(sa->n_syms) + sa->n_ssa + sa->n_seqs;
+	if ((fp = strcmp(fn, "-")? fopen(fn, "wb") : fdopen(fileno(stdout), "wb")) == 0) return -1;
+	fwrite("FSA\1", 1, 4, fp);
+	fwrite(&rate, 4, 1, fp);
+	fwrite(&sa->n_syms, 8, 1, fp);
+	fwrite(&sa->n_seqs, 8, 1, fp);
+	fwrite(&sa->n_ssa, 8, 1, fp);
+	if (fwrite(sa->bits, 8, n, fp) != n) {
+		fclose(fp);
+		return -1;
+	}
+	return fclose(fp) == 0? 0 : -1;
+}
+
+fmsa_t *fm_sa_restore(const char *fn, const rld_t *e)
+{
+	fmsa_t *sa;
+	struct stat st;
+	int fd;
+	uint8_t *mem;
+	uint64_t n_syms, n_seqs, n_ssa;
+	if ((fd = open(fn, O_RDONLY)) < 0) return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < SSA_HDR) {
+		close(fd);
+		return 0;
+	}
+	mem = (uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mem == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	memcpy(&n_syms, mem + 8, 8);
+	memcpy(&n_seqs, mem + 16, 8);
+	memcpy(&n_ssa, mem + 24, 8);
+	if (strncmp((char*)mem, "FSA\1", 4) != 0 || (uint64_t)st.st_size != SSA_HDR + (ssa_n_bits(n_syms) + ssa_n_cnt(n_syms) + n_ssa + n_seqs) * 8) {
+		if (fm_verbose >= 1) fprintf(stderr, "[E::%s] `%s' is not a valid sampled suffix array\n", __func__, fn);
+		munmap(mem, st.st_size); close(fd);
+		return 0;
+	}
+	sa = calloc(1, sizeof(fmsa_t));
+	memcpy(&sa->rate, mem + 4, 4);
+	sa->fd = fd, sa->mem = mem, sa->size = st.st_size;
+	sa->n_syms = n_syms, sa->n_seqs = n_seqs, sa->n_ssa = n_ssa;
+	ssa_set_ptr(sa, (uint64_t*)(mem + SSA_HDR));
+	if (e && (sa->n_syms != e->mcnt[0] || sa->n_seqs != e->mcnt[1])) {
+		if (fm_verbose >= 1) fprintf(stderr, "[E::%s] `%s' was not generated from the FM-index\n", __func__, fn);
+		fm_sa_destroy(sa);
+		return 0;
+	}
+	return sa;
+}
+
+int fm_locate(const rld_t *e, uint64_t k, uint64_t *read_id, uint64_t *offset)
+{
+	const fmsa_t *sa = e->sa;
+	uint64_t ok[6], d, x;
+	if (sa == 0 || k >= sa->n_syms) return -1;
+	for (d = 0; (sa->bits[k>>6] >> (k&63) & 1) == 0; ++d) { // LF walk until a sampled row; never passes offset 0
+		int c = rld_rank1a(e, k, ok);
+		k = e->cnt[c] + ok[c] - 1;
+	}
+	x = sa->ssa[ssa_rank(sa, k)];
+	*read_id = x >> FM_SA_OBITS;
+	*offset = (x & ((1ULL<<FM_SA_OBITS) - 1)) + d;
+	return 0;
+}
@@ -27,17 +27,20 @@ static void set_bits(const rld_t *e, const uint64_t *sub, uint64_t *bits, int st
 	}
 }
 
-static rld_t *gen_idx(rld_t *e0, uint64_t *bits, int is_comp)
-{
+static rld_t *gen_idx1(rld_t *e0, const uint64_t *bits, int is_comp, uint64_t beg, uint64_t end, int is_free)
+{ // encode the selected symbols in [beg,end) of e0
 	int c = 0, c0 = -1;
-	int64_t l, i, k = 0, len = 0;
+	int64_t l, i, len = 0;
+	uint64_t k = beg;
 	rld_t *e;
 	rlditr_t ritr, witr;
 
 	e = rld_init(e0->asize, e0->sbits);
 	rld_itr_init(e, &witr, 0);
-	rld_itr_init(e0, &ritr, 0);
-	while ((l = rld_dec(e0, &ritr, &c, 1)) >= 0) {
+	if (beg == 0) l = 0, rld_itr_init(e0, &ritr, 0);
+	else rld_itr_seek(e0, &ritr, beg), l = ritr.l, c = ritr.c;
+	while (k < end) {
+		if (l > (int64_t)(end - k)) l = end - k;
 		for (i = 0; i < l; ++i, ++k) {
 			if ((bits[k>>6]>>(k&0x3f)&1) == !is_comp) {
 				if (c != c0) {
@@ -46,11 +49,59 @@ static rld_t *gen_idx(rld_t *e0, uint64_t *bits, int is_comp)
 				} else ++len;
 			}
 		}
+		if (k < end && (l = rld_dec(e0, &ritr, &c, is_free)) < 0) break;
 	}
 	if (len) rld_enc(e, &witr, len, c0);
-	assert(k == e0->mcnt[0]);
+	assert(k == end);
+	rld_enc_finish_mt(e, &witr, 0);
+	return e;
+}
+
+typedef struct {
+	rld_t *e0;
+	const uint64_t *bits;
+	int is_comp;
+	uint64_t beg, end;
+	rld_t *e;
+} enc_worker_t;
+
+static void *enc_worker(void *data)
+{
+	enc_worker_t *w = (enc_worker_t*)data;
+	w->e = gen_idx1(w->e0, w->bits, w->is_comp, w->beg, w->end, 0);
+	return 0;
+}
+
+static rld_t *gen_idx(rld_t *e0, uint64_t *bits, int is_comp, int n_threads)
+{
+	rld_t **parts, *e;
+	int j;
+
+	if (n_threads > (int64_t)(e0->mcnt[0] >> 20) + 1) n_threads = (e0->mcnt[0] >> 20) + 1; // at least 1M symbols per segment
+	parts = (rld_t**)calloc(n_threads, sizeof(void*));
+	if (n_threads == 1) { // free e0 while decoding
+		parts[0] = gen_idx1(e0, bits, is_comp, 0, e0->mcnt[0], 1);
+	} else {
+		pthread_t *tid;
+		pthread_attr_t attr;
+		enc_worker_t *w;
+		tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+		w = (enc_worker_t*)calloc(n_threads, sizeof(enc_worker_t));
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+		for (j = 0; j < n_threads; ++j) {
+			w[j].e0 = e0, w[j].bits = bits, w[j].is_comp = is_comp;
+			w[j].beg = e0->mcnt[0] / n_threads * j;
+			w[j].end = j == n_threads - 1? e0->mcnt[0] : e0->mcnt[0] / n_threads * (j + 1);
+			pthread_create(&tid[j], &attr, enc_worker, w + j);
+		}
+		for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0);
+		for (j = 0; j < n_threads; ++j) parts[j] = w[j].e;
+		free(w); free(tid);
+	}
 	rld_destroy(e0);
-	rld_enc_finish(e, &witr);
+	e = rld_join(n_threads, parts, n_threads);
+	free(parts);
 	return e;
 }
 
@@ -91,7 +142,7 @@ rld_t *fm_sub(rld_t *e, const uint64_t *sub, int n_threads, int is_comp)
 	for (j = 0; j < n_threads; ++j) pthread_join(tid[j], 0);
 	free(tid); free(w);
 
-	r = gen_idx(e, bits, is_comp);
+	r = gen_idx(e, bits, is_comp, n_threads);
 	free(bits);
 	return r;
 }
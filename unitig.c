@@ -44,7 +44,20 @@ static fmintv_t overlap_intv(const rld_t *e, int len, const uint8_t *seq, int mi
 	end = at5? len : -1;
 	c = seq[j];
 	fm6_set_intv(e, c, ik);
-	for (depth = 1, j += dir; j != end; j += dir, ++depth) {
+	depth = 1;
+	if (e->kmi && min > 1) { // jump to depth min(k,min) with the k-mer interval table; no intervals are kept before depth min
+		int d, max_d = e->kmi->k < min? e->kmi->k : min;
+		uint64_t x = 0;
+		fmintv_t jk;
+		for (d = 0; d < max_d && j + dir * d != end; ++d) {
+			int b = seq[j + dir * d]; // forward extension with fm6_comp(b) appends b
+			if (b < 1 || b > 4) break;
+			x = at5? x<<2 | (b - 1) : x | (uint64_t)(b - 1) << (d<<1);
+		}
+		if (d > 1 && fm_kmi_get(e->kmi, d, x, &jk))
+			ik = jk, depth = d, j += dir * (d - 1);
+	}
+	for (j += dir; j != end; j += dir, ++depth) {
 		c = at5? fm6_comp(seq[j]) : seq[j];
 		fm6_extend(e, &ik, ok, !at5);
 		if (!ok[c].x[2]) break; // cannot be extended
@@ -96,7 +109,7 @@ int fm6_get_nei(const rld_t *e, int min_match, int beg, kstring_t *s, fmintv_v *
 {
 	int ori_l = s->l, j, i, c, rbeg, is_forked = 0;
 	fmintv_v *swap;
-	fmintv_t ok[6], ok0;
+	fmintv_t ok[6], ok0, okb[FM_BATCH][6];
 
 	curr->n = nei->n = cat->n = 0;
 	if (prev->n == 0) { // when this routine is called for the seed, prev may filled by fm6_is_contained()
@@ -108,13 +121,14 @@ int fm6_get_nei(const rld_t *e, int min_match, int beg, kstring_t *s, fmintv_v *
 	for (j = 0; j < prev->n; ++j) cat->a[j] = 0; // only one interval; all point to 0
 	while (prev->n) {
 		for (j = 0, curr->n = 0; j < prev->n; ++j) {
-			fmintv_t *p = &prev->a[j];
+			fmintv_t *p = &prev->a[j], *o = okb[j%FM_BATCH];
+			if (j % FM_BATCH == 0) // forward extension of the next batch of intervals
+				fm6_extend_batch(e, prev->n - j < FM_BATCH? prev->n - j : FM_BATCH, p, okb, 0);
 			if (cat->a[j] < 0) continue;
-			fm6_extend(e, p, ok, 0); // forward extension
-			if (ok[0].x[2] && ori_l != s->l) { // some (partial) reads end here
-				fm6_extend0(e, &ok[0], &ok0, 1); // backward extension to look for sentinels
+			if (o[0].x[2] && ori_l != s->l) { // some (partial) reads end here
+				fm6_extend0(e, &o[0], &ok0, 1); // backward extension to look for sentinels
 				if (ok0.x[2]) { // the match is bounded by sentinels - a full-length match
-					if (ok[0].x[2] == p->x[2] && p->x[2] == ok0.x[2]) { // never consider a read contained in another read
+					if (o[0].x[2] == p->x[2] && p->x[2] == ok0.x[2]) { // never consider a read contained in another read
 						int cat0 = cat->a[j]; // a category approximately corresponds to one neighbor, though not always
 						assert(j == 0 || cat->a[j] > cat->a[j-1]); // otherwise not irreducible
 						ok0.info = ori_l - (p->info&0xffffffffU);
@@ -123,14 +137,14 @@ int fm6_get_nei(const rld_t *e, int min_match, int beg, kstring_t *s, fmintv_v *
 						continue; // no need to go through for(c); do NOT set "used" as this neighbor may be rejected later
 					} else if (used) set_bits(used, &ok0, sorted); // the read is contained in another read; mark it as used
 				}
-			} // ~if(ok[0].x[2])
+			} // ~if(o[0].x[2])
 			if (cat->a[j] < 0) continue; // no need to proceed if we have finished this path
 			for (c = 1; c < 5; ++c) // collect extensible intervals
-				if (ok[c].x[2]) {
-					fm6_extend0(e, &ok[c], &ok0, 1);
+				if (o[c].x[2]) {
+					fm6_extend0(e, &o[c], &ok0, 1);
 					if (ok0.x[2]) { // do not extend intervals whose left end is not bounded by a sentinel
-						ok[c].info = (p->info&0xfffffff0ffffffffLLU) | (uint64_t)c<<32;
-						kv_push(fmintv_t, *curr, ok[c]);
+						o[c].info = (p->info&0xfffffff0ffffffffLLU) | (uint64_t)c<<32;
+						kv_push(fmintv_t, *curr, o[c]);
 					}
 				}
 		} // ~for(j)
@@ -185,15 +199,16 @@ static int try_right(aux_t *a, int beg, kstring_t *s)
 
 static int check_left_simple(aux_t *a, int beg, int rbeg, const kstring_t *s)
 {
-	fmintv_t ok[6];
+	fmintv_t okb[FM_BATCH][6];
 	fmintv_v *prev = &a->a[0], *curr = &a->a[1], *swap;
 	int i, j;
 
 	overlap_intv(a->e, s->l, (uint8_t*)s->s, a->min_match, rbeg, 1, prev, 1);
 	for (i = rbeg - 1; i >= beg; --i) {
 		for (j = 0, curr->n = 0; j < prev->n; ++j) {
-			fmintv_t *p = &prev->a[j];
-			fm6_extend(a->e, p, ok, 1);
+			fmintv_t *p = &prev->a[j], *ok = okb[j%FM_BATCH];
+			if (j % FM_BATCH == 0)
+				fm6_extend_batch(a->e, prev->n - j < FM_BATCH? prev->n - j : FM_BATCH, p, okb, 1);
 			if (ok[0].x[2]) set_bits(a->used, &ok[0], a->sorted); // some reads end here; they must be contained in a longer read
 			if (ok[0].x[2] + ok[(int)s->s[i]].x[2] != p->x[2]) return -1; // potential backward bifurcation
 			kv_push(fmintv_t, *curr, ok[(int)s->s[i]]);